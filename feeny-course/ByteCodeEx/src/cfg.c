@@ -0,0 +1,271 @@
+#include <stdint.h>
+#include "cfg.h"
+
+#define WORD_BITS (sizeof(unsigned long) * 8)
+
+//---------------------------------------------------------------------------
+//--------------------------------live sets----------------------------------
+//---------------------------------------------------------------------------
+
+LiveSet make_live_set(CFG* cfg) {
+    return calloc(cfg->set_words, sizeof(unsigned long));
+}
+
+LiveSet copy_live_set(CFG* cfg, LiveSet set) {
+    LiveSet copy = malloc(sizeof(unsigned long) * cfg->set_words);
+    memcpy(copy, set, sizeof(unsigned long) * cfg->set_words);
+    return copy;
+}
+
+int live_contains(LiveSet set, int var) {
+    return (set[var / WORD_BITS] >> (var % WORD_BITS)) & 1;
+}
+
+void live_add(LiveSet set, int var) {
+    set[var / WORD_BITS] |= 1UL << (var % WORD_BITS);
+}
+
+void live_remove(LiveSet set, int var) {
+    set[var / WORD_BITS] &= ~(1UL << (var % WORD_BITS));
+}
+
+//---------------------------------------------------------------------------
+//--------------------------------blocks-------------------------------------
+//---------------------------------------------------------------------------
+
+ByteIns* get_ins(CFG* cfg, int i) {
+    return (ByteIns*) vector_get(cfg->method->code, i);
+}
+
+// Instructions after which the GC may observe the frame: allocations, and
+// calls that leave the frame suspended while the callee runs.
+int is_safepoint(ByteIns* ins) {
+    switch(ins->tag) {
+        case ARRAY_OP:
+        case OBJECT_OP:
+        case CALL_OP:
+        case CALL_SLOT_OP:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int ends_block(ByteIns* ins) {
+    return ins->tag == BRANCH_OP || ins->tag == GOTO_OP || ins->tag == RETURN_OP;
+}
+
+void find_blocks(CFG* cfg) {
+    int n = cfg->method->code->size;
+    char* leader = calloc(n + 1, 1);
+    leader[0] = 1;
+    for (int i = 0; i < n; i++) {
+        ByteIns* ins = get_ins(cfg, i);
+        if (ins->tag == LABEL_OP) leader[i] = 1;
+        if (ends_block(ins)) leader[i + 1] = 1;
+    }
+    cfg->nblocks = 0;
+    for (int i = 0; i < n; i++) {
+        if (leader[i]) cfg->nblocks++;
+    }
+    cfg->blocks = calloc(cfg->nblocks, sizeof(Block));
+    int b = -1;
+    for (int i = 0; i < n; i++) {
+        if (leader[i]) {
+            b++;
+            cfg->blocks[b].start = i;
+        }
+        cfg->blocks[b].end = i + 1;
+    }
+    free(leader);
+}
+
+void link_blocks(CFG* cfg) {
+    int max_label = -1;
+    for (int b = 0; b < cfg->nblocks; b++) {
+        ByteIns* first = get_ins(cfg, cfg->blocks[b].start);
+        if (first->tag == LABEL_OP) max_label = max(max_label, ((LabelIns*) first)->name);
+    }
+    int* label_block = malloc(sizeof(int) * (max_label + 1));
+    for (int b = 0; b < cfg->nblocks; b++) {
+        ByteIns* first = get_ins(cfg, cfg->blocks[b].start);
+        if (first->tag == LABEL_OP) label_block[((LabelIns*) first)->name] = b;
+    }
+    for (int b = 0; b < cfg->nblocks; b++) {
+        Block* block = &cfg->blocks[b];
+        ByteIns* last = get_ins(cfg, block->end - 1);
+        block->nsucc = 0;
+        switch(last->tag) {
+            case BRANCH_OP:
+                block->succ[block->nsucc++] = label_block[((BranchIns*) last)->name];
+                if (b + 1 < cfg->nblocks) block->succ[block->nsucc++] = b + 1;
+                break;
+            case GOTO_OP:
+                block->succ[block->nsucc++] = label_block[((GotoIns*) last)->name];
+                break;
+            case RETURN_OP:
+                break;
+            default:
+                if (b + 1 < cfg->nblocks) block->succ[block->nsucc++] = b + 1;
+                break;
+        }
+    }
+    free(label_block);
+}
+
+CFG* build_cfg(MethodValue* method) {
+    CFG* cfg = malloc(sizeof(CFG));
+    cfg->method = method;
+    cfg->nvars = method->nargs + method->nlocals;
+    cfg->set_words = max(1, (cfg->nvars + WORD_BITS - 1) / WORD_BITS);
+    cfg->nblocks = 0;
+    cfg->blocks = NULL;
+    cfg->live_after = NULL;
+    if (method->code->size > 0) {
+        find_blocks(cfg);
+        link_blocks(cfg);
+    }
+    return cfg;
+}
+
+//---------------------------------------------------------------------------
+//--------------------------------liveness-----------------------------------
+//---------------------------------------------------------------------------
+
+// Steps a live set backwards over one instruction.
+void transfer(ByteIns* ins, LiveSet live) {
+    if (ins->tag == SET_LOCAL_OP) live_remove(live, ((SetLocalIns*) ins)->idx);
+    if (ins->tag == GET_LOCAL_OP) live_add(live, ((GetLocalIns*) ins)->idx);
+}
+
+int update_block(CFG* cfg, Block* block, LiveSet scratch) {
+    for (int s = 0; s < block->nsucc; s++) {
+        LiveSet succ_in = cfg->blocks[block->succ[s]].live_in;
+        for (int w = 0; w < cfg->set_words; w++) {
+            block->live_out[w] |= succ_in[w];
+        }
+    }
+    memcpy(scratch, block->live_out, sizeof(unsigned long) * cfg->set_words);
+    for (int i = block->end - 1; i >= block->start; i--) {
+        transfer(get_ins(cfg, i), scratch);
+    }
+    int changed = memcmp(scratch, block->live_in, sizeof(unsigned long) * cfg->set_words);
+    memcpy(block->live_in, scratch, sizeof(unsigned long) * cfg->set_words);
+    return changed;
+}
+
+void record_live_after(CFG* cfg, Block* block, LiveSet scratch) {
+    memcpy(scratch, block->live_out, sizeof(unsigned long) * cfg->set_words);
+    for (int i = block->end - 1; i >= block->start; i--) {
+        ByteIns* ins = get_ins(cfg, i);
+        if (is_safepoint(ins)) cfg->live_after[i] = copy_live_set(cfg, scratch);
+        transfer(ins, scratch);
+    }
+}
+
+void compute_liveness(CFG* cfg) {
+    for (int b = 0; b < cfg->nblocks; b++) {
+        cfg->blocks[b].live_in = make_live_set(cfg);
+        cfg->blocks[b].live_out = make_live_set(cfg);
+    }
+    LiveSet scratch = make_live_set(cfg);
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int b = cfg->nblocks - 1; b >= 0; b--) {
+            if (update_block(cfg, &cfg->blocks[b], scratch)) changed = 1;
+        }
+    }
+    cfg->live_after = calloc(cfg->method->code->size, sizeof(LiveSet));
+    for (int b = 0; b < cfg->nblocks; b++) {
+        record_live_after(cfg, &cfg->blocks[b], scratch);
+    }
+    free(scratch);
+}
+
+//---------------------------------------------------------------------------
+//--------------------------------stack depth--------------------------------
+//---------------------------------------------------------------------------
+
+int object_arity(Program* program, int class_idx) {
+    ClassValue* class = vector_get(program->values, class_idx);
+    int arity = 0;
+    for (int i = 0; i < class->slots->size; i++) {
+        Value* value = vector_get(program->values, (intptr_t) vector_get(class->slots, i));
+        if (value->tag == SLOT_VAL) arity++;
+    }
+    return arity;
+}
+
+// Net number of operand stack entries an instruction pushes.
+int stack_effect(Program* program, ByteIns* ins) {
+    switch(ins->tag) {
+        case LIT_OP:
+        case GET_LOCAL_OP:
+        case GET_GLOBAL_OP:
+            return 1;
+        case PRINTF_OP:
+            return 1 - ((PrintfIns*) ins)->arity;
+        case OBJECT_OP:
+            return -object_arity(program, ((ObjectIns*) ins)->class);
+        case CALL_SLOT_OP:
+            return 1 - ((CallSlotIns*) ins)->arity;
+        case CALL_OP:
+            return 1 - ((CallIns*) ins)->arity;
+        case ARRAY_OP:
+        case SET_SLOT_OP:
+        case BRANCH_OP:
+        case RETURN_OP:
+        case DROP_OP:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+// The compiler keeps the stack height at every label the same on all
+// incoming edges, so each block only has to be visited once.
+int max_stack_depth(CFG* cfg, Program* program) {
+    if (cfg->nblocks == 0) return 0;
+    int* height = malloc(sizeof(int) * cfg->nblocks);
+    int* work = malloc(sizeof(int) * cfg->nblocks);
+    for (int b = 0; b < cfg->nblocks; b++) {
+        height[b] = -1;
+    }
+    int nwork = 0;
+    int max_depth = 0;
+    height[0] = 0;
+    work[nwork++] = 0;
+    while (nwork > 0) {
+        Block* block = &cfg->blocks[work[--nwork]];
+        int h = height[block - cfg->blocks];
+        for (int i = block->start; i < block->end; i++) {
+            h += stack_effect(program, get_ins(cfg, i));
+            max_depth = max(max_depth, h);
+        }
+        for (int s = 0; s < block->nsucc; s++) {
+            if (height[block->succ[s]] < 0) {
+                height[block->succ[s]] = h;
+                work[nwork++] = block->succ[s];
+            }
+        }
+    }
+    free(height);
+    free(work);
+    return max_depth;
+}
+
+void free_cfg(CFG* cfg) {
+    for (int b = 0; b < cfg->nblocks; b++) {
+        free(cfg->blocks[b].live_in);
+        free(cfg->blocks[b].live_out);
+    }
+    if (cfg->live_after) {
+        for (int i = 0; i < cfg->method->code->size; i++) {
+            free(cfg->live_after[i]);
+        }
+        free(cfg->live_after);
+    }
+    free(cfg->blocks);
+    free(cfg);
+}
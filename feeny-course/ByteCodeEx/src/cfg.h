@@ -0,0 +1,40 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "bytecode.h"
+
+// Control flow graph and local liveness over the bytecode of one method.
+// Variables are numbered like GET_LOCAL_OP/SET_LOCAL_OP: arguments first,
+// then the method's locals.
+
+typedef unsigned long* LiveSet;
+
+typedef struct {
+    int start;
+    int end;
+    int nsucc;
+    int succ[2];
+    LiveSet live_in;
+    LiveSet live_out;
+} Block;
+
+typedef struct {
+    MethodValue* method;
+    int nvars;
+    int set_words;
+    int nblocks;
+    Block* blocks;
+    // Variables live after each safepoint instruction, NULL elsewhere.
+    LiveSet* live_after;
+} CFG;
+
+CFG* build_cfg(MethodValue* method);
+void compute_liveness(CFG* cfg);
+void free_cfg(CFG* cfg);
+
+int max_stack_depth(CFG* cfg, Program* program);
+
+int is_safepoint(ByteIns* ins);
+int live_contains(LiveSet set, int var);
+
+#endif
@@ -12,12 +12,27 @@ void init_classes(Quicken* q) {
     }
 }
 
-Quicken* init_quicken(Program* program){
+Quicken* init_quicken(Program* program, void** handlers){
     Quicken* q = malloc(sizeof(Quicken));
     q->patch_buffer = make_vector();
     q->globals = make_vector();
+    q->stack_map = make_vector();
     q->program = program;
-    q->hm = ht_create();
+    q->handlers = handlers;
+    q->entries = calloc(program->values->size, sizeof(Entry));
+    q->global_idx = malloc(sizeof(int) * program->values->size);
+    q->global_use = calloc(program->values->size, sizeof(GlobalUse));
+    for (int i = 0; i < program->values->size; i++) {
+        q->global_idx[i] = -1;
+        q->global_use[i].literal = -1;
+        q->global_use[i].once_id = -1;
+        q->global_use[i].leaf = -1;
+    }
+    q->once_globals = make_vector();
+    q->slot_sites = make_vector();
+    q->formats = make_vector();
+    q->selector_ids = ht_create();
+    q->selectors = make_vector();
     q->code_buffer = init_code_buffer();
     init_classes(q);
     return q;
@@ -28,6 +43,11 @@ VMInfo* create_vm_info(Quicken* q, char* ip) {
     vm_info->classes = q->classes;
     vm_info->code_buffer = q->code_buffer;
     vm_info->const_pool = q->program->values;
+    vm_info->stack_map = q->stack_map;
+    vm_info->once_globals = q->once_globals;
+    vm_info->slot_sites = q->slot_sites;
+    vm_info->selectors = q->selectors;
+    vm_info->formats = q->formats;
     vm_info->ip = ip;
     vm_info->globals_size = q->globals->size;
     return vm_info;
@@ -36,7 +56,10 @@ VMInfo* create_vm_info(Quicken* q, char* ip) {
 void free_quicken(Quicken* q) {
     vector_free(q->patch_buffer);
     vector_free(q->globals);
-    ht_destroy(q->hm);
+    free(q->entries);
+    free(q->global_idx);
+    free(q->global_use);
+    ht_destroy(q->selector_ids);
     vector_free(q->program->slots);
     free(q->program);
     free(q);
@@ -45,61 +68,134 @@ void free_quicken(Quicken* q) {
 //---------------------------------------------------------------------------
 //--------------------------------Entries------------------------------------
 //---------------------------------------------------------------------------
-void add_entry(Quicken* q, char* key, int tag) {
-    Entry* entry = malloc(sizeof(Entry));
+// Entries are indexed directly by constant pool id: labels and methods by
+// their own id, classes by the class value, and global methods by name.
+void add_entry(Quicken* q, int const_pool_idx, int tag) {
+    Entry* entry = &q->entries[const_pool_idx];
     entry->code_idx = get_code_idx(q->code_buffer);
     entry->type = tag;
-    ht_set(q->hm, key, entry);
 }
 
-
 void add_class_entry(Quicken* q, int const_pool_idx, int class_idx) {
-    char int_char[11];
-    sprintf(int_char,"%d", const_pool_idx);
-    Entry* entry = malloc(sizeof(Entry));
+    Entry* entry = &q->entries[const_pool_idx];
     entry->type = CLASS_ENTRY;
     entry->class_idx = class_idx;
-    ht_set(q->hm, int_char, entry);
-}
-
-void add_int_entry(Quicken* q, int const_pool_idx, int tag) {
-    char int_char[11];
-    sprintf(int_char,"%d", const_pool_idx);
-    add_entry(q, int_char, tag);
 }
 
-Entry* get_entry(Quicken* q, char* key) {
-    return (Entry*) ht_get(q->hm, key);
-}
-
-Entry* get_entry_by_int(Quicken* q, int const_pool_idx) {
-    char int_char[11];
-    sprintf(int_char,"%d", const_pool_idx);
-    return get_entry(q, int_char);
+Entry* get_entry(Quicken* q, int const_pool_idx) {
+    Entry* entry = &q->entries[const_pool_idx];
+    if (entry->type == NO_ENTRY) {
+        printf("No entry for constant #%d.\n", const_pool_idx);
+        exit(-1);
+    }
+    return entry;
 }
 
-Entry* link_entries_with_int(Quicken* q, Entry* entry, int name) {
-    char int_char[11];
-    sprintf(int_char,"%d", name);
-    ht_set(q->hm, int_char, entry);
+void link_entries(Quicken* q, Entry* entry, int name) {
+    q->entries[name] = *entry;
 }
 
 //---------------------------------------------------------------------------
 //--------------------------------globals------------------------------------
 //---------------------------------------------------------------------------
 
+void add_global(Quicken* q, int name) {
+    q->global_idx[name] = q->globals->size;
+    vector_add(q->globals, (void*) name);
+}
+
 int get_global_idx(Quicken* q, int name) {
-    for (int i = 0; i < q->globals->size; i++) {
-        int gname = (int) vector_get(q->globals, i);
-        if (name == gname) return i;
+    int idx = q->global_idx[name];
+    if (idx < 0) {
+        printf("No global with name %d.\n", name);
+        exit(-1);
     }
-    printf("No global with name %d.\n", name);
-    exit(-1);
+    return idx;
 }
 
-//---------------------------------------------------------------------------
-//--------------------------------Patches------------------------------------
-//---------------------------------------------------------------------------
+// A global whose only write is `lit; set-global` in the straight-line start
+// of the entry method, ahead of any call or read of it, can never be seen
+// with another value and its loads become the literal. Globals with a single
+// write of any other kind go through the write-once table instead.
+void promote_literal_globals(Quicken* q, MethodValue* entry) {
+    for (int j = 0; j < entry->code->size; j++) {
+        ByteIns* ins = vector_get(entry->code, j);
+        switch(ins->tag) {
+            case LABEL_OP:
+            case BRANCH_OP:
+            case GOTO_OP:
+            case RETURN_OP:
+            case CALL_OP:
+            case CALL_SLOT_OP:
+                return;
+            case GET_GLOBAL_OP: {
+                GlobalUse* use = &q->global_use[((GetGlobalIns*) ins)->name];
+                if (use->literal < 0) use->read_early = 1;
+                break;
+            }
+            case SET_GLOBAL_OP: {
+                GlobalUse* use = &q->global_use[((SetGlobalIns*) ins)->name];
+                ByteIns* prev = (j > 0) ? vector_get(entry->code, j - 1) : ins;
+                if (use->nsets != 1 || use->read_early || prev->tag != LIT_OP) break;
+                Value* value = vector_get(q->program->values, ((LitIns*) prev)->idx);
+                if (value->tag == INT_VAL || value->tag == NULL_VAL) use->literal = ((LitIns*) prev)->idx;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+// A function with no locals, allocations or direct calls usually runs
+// without ever being walked by the GC: its call sites mostly reach int and
+// array builtins, which need no frame. Its frame then needs no saved fp or
+// return ip. Calls to it become CALL_LEAF_INS and its returns
+// RETURN_LEAF_INS, which keep both in runvm's registers instead; a call
+// site that does reach a method writes them into the frame first. The
+// entry method is left alone as it is run through its FRAME_INS.
+int is_leaf(MethodValue* method) {
+    if (method->nlocals > 0) return 0;
+    for (int j = 0; j < method->code->size; j++) {
+        ByteIns* ins = vector_get(method->code, j);
+        if (is_safepoint(ins) && ins->tag != CALL_SLOT_OP) return 0;
+    }
+    return 1;
+}
+
+void find_leaf_functions(Quicken* q) {
+    for (int i = 0; i < q->program->slots->size; i++) {
+        int idx = (intptr_t) vector_get(q->program->slots, i);
+        Value* value = vector_get(q->program->values, idx);
+        if (value->tag != METHOD_VAL || idx == q->program->entry) continue;
+        MethodValue* method = (MethodValue*) value;
+        if (is_leaf(method)) q->global_use[method->name].leaf = idx;
+    }
+}
+
+void analyse_globals(Quicken* q) {
+    for (int i = 0; i < q->program->values->size; i++) {
+        Value* value = vector_get(q->program->values, i);
+        if (value->tag != METHOD_VAL) continue;
+        Vector* code = ((MethodValue*) value)->code;
+        for (int j = 0; j < code->size; j++) {
+            ByteIns* ins = vector_get(code, j);
+            if (ins->tag == SET_GLOBAL_OP) q->global_use[((SetGlobalIns*) ins)->name].nsets++;
+        }
+    }
+    promote_literal_globals(q, vector_get(q->program->values, q->program->entry));
+    for (int i = 0; i < q->program->values->size; i++) {
+        GlobalUse* use = &q->global_use[i];
+        if (use->nsets != 1 || use->literal >= 0) continue;
+        OnceGlobal* once = malloc(sizeof(OnceGlobal));
+        once->state = ONCE_UNSET;
+        once->global = -1;
+        once->sites = make_vector();
+        use->once_id = q->once_globals->size;
+        vector_add(q->once_globals, once);
+    }
+    find_leaf_functions(q);
+}
 
 //---------------------------------------------------------------------------
 //--------------------------------Patches------------------------------------
@@ -113,16 +209,31 @@ void make_patch(Quicken* q, int name, int tag) {
     vector_add(q->patch_buffer, patch);
 }
 
-void write_patch_pointer(Quicken* q, int name, int tag) {
-    align_ptr(q->code_buffer);
+void write_patch_offset(Quicken* q, int name, int tag) {
     make_patch(q, name, tag);
-    write_ptr(q->code_buffer, 0);
+    write_int(q->code_buffer, 0);
 }
 
-void write_patch_int(Quicken* q, int name, int tag) {
-    align_int(q->code_buffer);
+void write_patch_short(Quicken* q, int name, int tag) {
     make_patch(q, name, tag);
-    write_int(q->code_buffer, 0);
+    write_short(q->code_buffer, 0);
+}
+
+void write_op(Quicken* q, OpTag tag) {
+    q->last_op = tag;
+    #ifdef THREADED
+        write_ptr(q->code_buffer, q->handlers[tag]);
+    #else
+        write_char(q->code_buffer, tag);
+    #endif
+}
+
+void patch_op(Quicken* q, int pos, OpTag tag) {
+    #ifdef THREADED
+        memcpy(q->code_buffer->code + pos, &q->handlers[tag], sizeof(void*));
+    #else
+        q->code_buffer->code[pos] = tag;
+    #endif
 }
 
 //---------------------------------------------------------------------------
@@ -134,6 +245,46 @@ char* idx_to_str(Quicken* q, int idx) {
     return value->value;
 }
 
+// Slot names are interned to small selector ids so that the same name used
+// by different classes and call sites compares and hashes as one integer.
+int intern_selector(Quicken* q, int name) {
+    char* str = idx_to_str(q, name);
+    int id = (intptr_t) ht_get(q->selector_ids, str);
+    if (id == 0) {
+        vector_add(q->selectors, str);
+        id = q->selectors->size;
+        ht_set(q->selector_ids, str, (void*) (intptr_t) id);
+    }
+    return id - 1;
+}
+
+int fill_slot_table(CClass* cclass) {
+    for (int i = 0; i <= cclass->mask; i++) {
+        cclass->table[i] = -1;
+    }
+    for (int i = 0; i < cclass->nslots; i++) {
+        short* bucket = &cclass->table[cclass->slots[i].sel & cclass->mask];
+        if (*bucket < 0) {
+            *bucket = i;
+        } else if (cclass->slots[*bucket].sel != cclass->slots[i].sel) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void make_slot_table(CClass* cclass) {
+    int size = 1;
+    while (size < cclass->nslots) size *= 2;
+    while (1) {
+        cclass->mask = size - 1;
+        cclass->table = malloc(sizeof(short) * size);
+        if (fill_slot_table(cclass)) return;
+        free(cclass->table);
+        size *= 2;
+    }
+}
+
 int make_class(Quicken* q, ClassValue* class) {
     CClass* cclass = malloc(sizeof(CClass));
     cclass->nvars = 0;
@@ -147,6 +298,7 @@ int make_class(Quicken* q, ClassValue* class) {
                 SlotValue* sval = (SlotValue*) value;
                 cclass->slots[i].tag = VAR_SLOT;
                 cclass->slots[i].name = idx_to_str(q, sval->name);
+                cclass->slots[i].sel = intern_selector(q, sval->name);
                 cclass->slots[i].idx = cclass->nvars;
                 cclass->nvars++;
                 break;
@@ -154,19 +306,94 @@ int make_class(Quicken* q, ClassValue* class) {
                 MethodValue* mval = (MethodValue*)value;
                 cclass->slots[i].tag = CODE_SLOT;
                 cclass->slots[i].name = idx_to_str(q, mval->name);
-                Entry* entry = get_entry_by_int(q, const_pool_idx);
+                cclass->slots[i].sel = intern_selector(q, mval->name);
+                Entry* entry = get_entry(q, const_pool_idx);
                 cclass->slots[i].code = q->code_buffer->code + entry->code_idx;
                 break;
             }
         }
     }
+    make_slot_table(cclass);
     vector_add(q->classes, cclass);
     return q->classes->size - 1;
 }
+//---------------------------------------------------------------------------
+//--------------------------------formats------------------------------------
+//---------------------------------------------------------------------------
+
+// The runs point into the format string, which lives as long as the program.
+Format* parse_format(Quicken* q, char* str) {
+    int nruns = 1;
+    for (char* c = str; *c != '\0'; c++) {
+        if (*c == '~') nruns++;
+    }
+    Format* format = malloc(sizeof(Format) + sizeof(FormatRun) * nruns);
+    format->nruns = nruns;
+    char* start = str;
+    for (int i = 0; i < nruns; i++) {
+        char* end = start;
+        while (*end != '~' && *end != '\0') end++;
+        format->runs[i].text = start;
+        format->runs[i].len = end - start;
+        start = end + 1;
+    }
+    vector_add(q->formats, format);
+    return format;
+}
+
 //---------------------------------------------------------------------------
 //--------------------------------parse_ops----------------------------------
 //---------------------------------------------------------------------------
 
+void write_slot_cache(Quicken* q) {
+    #ifdef IC_STATS
+        vector_add(q->slot_sites, (void*) get_code_idx(q->code_buffer));
+    #endif
+    for (size_t k = 0; k < sizeof(SlotCache); k++) {
+        write_char(q->code_buffer, 0);
+    }
+}
+
+void write_literal(Quicken* q, int const_pool_idx) {
+    Value* value = vector_get(q->program->values, const_pool_idx);
+    if (value->tag == INT_VAL) {
+        write_op(q, INT_INS);
+        write_int(q->code_buffer, ((IntValue*)value)->value);
+    } else if (value->tag == NULL_VAL) {
+        write_op(q, NULL_INS);
+    }
+}
+
+// Load sites of write-once globals leave room for the value so the VM can
+// turn them into CONST_INS in place.
+void write_get_global(Quicken* q, int name) {
+    GlobalUse* use = &q->global_use[name];
+    if (use->literal >= 0) {
+        write_literal(q, use->literal);
+    } else if (use->once_id >= 0) {
+        OnceGlobal* once = vector_get(q->once_globals, use->once_id);
+        vector_add(once->sites, (void*) (intptr_t) get_code_idx(q->code_buffer));
+        write_op(q, GET_GLOBAL_ONCE_INS);
+        write_patch_short(q, name, INT_PATCH);
+        write_ptr(q->code_buffer, 0);
+    } else {
+        write_op(q, GET_GLOBAL_INS);
+        write_patch_short(q, name, INT_PATCH);
+    }
+}
+
+void write_set_global(Quicken* q, int name) {
+    GlobalUse* use = &q->global_use[name];
+    if (use->once_id >= 0) {
+        write_op(q, SET_GLOBAL_ONCE_INS);
+        write_patch_short(q, name, INT_PATCH);
+        write_short(q->code_buffer, use->once_id);
+    } else {
+        write_op(q, SET_GLOBAL_INS);
+        write_patch_short(q, name, INT_PATCH);
+    }
+}
+
 void parse_ops(Quicken* q, ByteIns* ins) {
     switch(ins->tag) { 
         case LABEL_OP: {
@@ -174,7 +401,7 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("label #%d", i->name);
             #endif
-            add_int_entry(q, i->name, LABEL_ENTRY);
+            add_entry(q, i->name, LABEL_ENTRY);
             break;
         }
         case LIT_OP: {
@@ -182,13 +409,7 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   lit #%d", i->idx);
             #endif
-            Value* value = vector_get(q->program->values, i->idx);
-            if (value->tag == INT_VAL) {
-                write_int(q->code_buffer, INT_INS);
-                write_int(q->code_buffer, ((IntValue*)value)->value);
-            } else if (value->tag == NULL_VAL) {
-                write_int(q->code_buffer, NULL_INS);
-            }
+            write_literal(q, i->idx);
             break;
         }
         case PRINTF_OP: {
@@ -196,17 +417,17 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   printf #%d %d", i->format, i->arity);
             #endif
-            write_int(q->code_buffer, PRINTF_INS);
-            write_int(q->code_buffer, i->arity);
+            write_op(q, PRINTF_INS);
+            write_short(q->code_buffer, i->arity);
             StringValue* str = vector_get(q->program->values, i->format);
-            write_ptr(q->code_buffer, str->value);
+            write_ptr(q->code_buffer, parse_format(q, str->value));
             break;
         }
         case ARRAY_OP: {
             #ifdef DEBUG
                 printf("   array");
             #endif
-            write_int(q->code_buffer, ARRAY_INS);
+            write_op(q, ARRAY_INS);
             break;
         }
         case OBJECT_OP: {
@@ -214,9 +435,9 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   object #%d", i->class);
             #endif
-            write_int(q->code_buffer, OBJECT_INS);
-            write_patch_int(q, i->class, CLASS_ARITY_PATCH);
-            write_patch_int(q, i->class, CLASS_TAG_PATCH);
+            write_op(q, OBJECT_INS);
+            write_patch_short(q, i->class, CLASS_ARITY_PATCH);
+            write_patch_short(q, i->class, CLASS_TAG_PATCH);
             break;
         }
         case SLOT_OP: {
@@ -224,8 +445,9 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   slot #%d", i->name);
             #endif
-            write_int(q->code_buffer, SLOT_INS);
-            write_ptr(q->code_buffer, idx_to_str(q, i->name));
+            write_op(q, SLOT_INS);
+            write_short(q->code_buffer, intern_selector(q, i->name));
+            write_slot_cache(q);
             break;
         }
         case SET_SLOT_OP: {
@@ -233,8 +455,9 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   set-slot #%d", i->name);
             #endif
-            write_int(q->code_buffer, SET_SLOT_INS);
-            write_ptr(q->code_buffer, idx_to_str(q, i->name));
+            write_op(q, SET_SLOT_INS);
+            write_short(q->code_buffer, intern_selector(q, i->name));
+            write_slot_cache(q);
             break;
         }
         case CALL_SLOT_OP: {
@@ -242,10 +465,12 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   call-slot #%d %d", i->name, i->arity);
             #endif
-            write_int(q->code_buffer, CALL_SLOT_INS);
-            write_int(q->code_buffer, i->arity);
-            StringValue* str = vector_get(q->program->values, i->name);
-            write_ptr(q->code_buffer, str->value);
+            write_op(q, CALL_SLOT_INS);
+            write_short(q->code_buffer, i->arity);
+            write_short(q->code_buffer, intern_selector(q, i->name));
+            for (size_t k = 0; k < IC_SIZE; k++) {
+                write_char(q->code_buffer, 0);
+            }
             break;
         }
         case CALL_OP: {
@@ -253,9 +478,9 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   call #%d %d", i->name, i->arity);
             #endif
-            write_int(q->code_buffer, CALL_INS);
-            write_int(q->code_buffer, i->arity);
-            write_patch_pointer(q, i->name, FUNCTION_PATCH);
+            write_op(q, q->global_use[i->name].leaf >= 0 ? CALL_LEAF_INS : CALL_INS);
+            write_short(q->code_buffer, i->arity);
+            write_patch_offset(q, i->name, FUNCTION_PATCH);
         break;
         }
         case SET_LOCAL_OP: {
@@ -263,8 +488,8 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   set local %d", i->idx);
             #endif
-            write_int(q->code_buffer, SET_LOCAL_INS);
-            write_int(q->code_buffer, i->idx);
+            write_op(q, SET_LOCAL_INS);
+            write_short(q->code_buffer, i->idx - q->nvars);
             break;
         }
         case GET_LOCAL_OP: {
@@ -272,8 +497,8 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   get local %d", i->idx);
             #endif
-            write_int(q->code_buffer, GET_LOCAL_INS);
-            write_int(q->code_buffer, i->idx);
+            write_op(q, GET_LOCAL_INS);
+            write_short(q->code_buffer, i->idx - q->nvars);
             break;
         }
         case SET_GLOBAL_OP: {
@@ -281,8 +506,7 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   set global #%d", i->name);
             #endif
-            write_int(q->code_buffer, SET_GLOBAL_INS);
-            write_patch_int(q, i->name, INT_PATCH);
+            write_set_global(q, i->name);
             break;
         }
         case GET_GLOBAL_OP: {
@@ -290,8 +514,7 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   get global #%d", i->name);
             #endif
-            write_int(q->code_buffer, GET_GLOBAL_INS);
-            write_patch_int(q, i->name, INT_PATCH);
+            write_get_global(q, i->name);
             break;
         }
         case BRANCH_OP: {
@@ -299,8 +522,8 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   branch #%d", i->name);
             #endif
-            write_int(q->code_buffer, BRANCH_INS);
-            write_patch_pointer(q, i->name, LABEL_PATCH);
+            write_op(q, BRANCH_INS);
+            write_patch_offset(q, i->name, LABEL_PATCH);
             break;
         }
         case GOTO_OP: {
@@ -308,22 +531,23 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   goto #%d", i->name);
             #endif
-            write_int(q->code_buffer, GOTO_INS);
-            write_patch_pointer(q, i->name, LABEL_PATCH);
+            write_op(q, GOTO_INS);
+            write_patch_offset(q, i->name, LABEL_PATCH);
             break;
         }
         case RETURN_OP: {
             #ifdef DEBUG
                 printf("   return");
             #endif
-                write_int(q->code_buffer, RETURN_INS);
+            write_op(q, q->leaf ? RETURN_LEAF_INS : RETURN_INS);
+            write_short(q->code_buffer, q->nvars);
             break;
         }
         case DROP_OP: {
             #ifdef DEBUG
                 printf("   drop");
             #endif
-            write_int(q->code_buffer, DROP_INS);
+            write_op(q, DROP_INS);
             break;
         }
         default: {
@@ -333,23 +557,132 @@ void parse_ops(Quicken* q, ByteIns* ins) {
     }
 }
 
+//---------------------------------------------------------------------------
+//--------------------------------superinstructions--------------------------
+//---------------------------------------------------------------------------
+
+// Fused handlers for the hottest opcode sequences in an -DOP_STATS run,
+// longest first. Sequences containing a call site or a global are left out
+// since the VM rewrites those op slots at runtime.
+// Only the first opcode of a match is replaced: the remaining opcodes and
+// all operands stay in place, so the fused handler steps over them and a
+// branch into the middle of a sequence still finds plain instructions.
+// Labels emit no code and may sit inside a match. Build with
+// -DNO_SUPERINSTRUCTIONS to keep the plain instruction stream.
+//
+// The rows live in superinstructions.h. To regenerate them, build with
+// -DOP_STATS -DNO_SUPERINSTRUCTIONS, run a representative program, and copy
+// the superinstructions.h it writes to the working directory over the one
+// in src/. A row whose fused tag does not exist yet fails to compile here:
+// add the OpTag and its handler in vm.c, or delete the row.
+#define SUPER_MAX 4
+
+typedef struct {
+    int n;
+    OpTag ops[SUPER_MAX];
+    OpTag fused;
+} SuperIns;
+
+static SuperIns superinstructions[] = {
+#include "superinstructions.h"
+};
+
+#define NSUPERINSTRUCTIONS (sizeof(superinstructions) / sizeof(SuperIns))
+
+// Number of instructions from j covered by super, labels included, or 0.
+int match_superinstruction(SuperIns* super, int* op_tag, int n, int j) {
+    int k = j;
+    for (int i = 0; i < super->n; i++) {
+        while (k < n && op_tag[k] < 0) k++;
+        if (k == n || op_tag[k] != (int) super->ops[i]) return 0;
+        k++;
+    }
+    return k - j;
+}
+
+// op_pos and op_tag give the code offset and opcode written for each
+// instruction of a method, with -1 tags for labels.
+void fuse_superinstructions(Quicken* q, int* op_pos, int* op_tag, int n) {
+#ifndef NO_SUPERINSTRUCTIONS
+    int j = 0;
+    while (j < n) {
+        int len = 0;
+        if (op_tag[j] >= 0) {
+            for (size_t s = 0; s < NSUPERINSTRUCTIONS && !len; s++) {
+                len = match_superinstruction(&superinstructions[s], op_tag, n, j);
+                if (len) patch_op(q, op_pos[j], superinstructions[s].fused);
+            }
+        }
+        j += len ? len : 1;
+    }
+#endif
+}
+
+// An int comparison whose result only feeds a BRANCH_OP is written as a
+// BR_*_INS site. The call site keeps its operands and the BRANCH_INS stays
+// in place behind it, so runvm can turn a site that sees another receiver
+// back into a plain CALL_SLOT_INS and let the branch test the result.
+typedef struct {
+    char* name;
+    OpTag tag;
+} CompareBranch;
+
+static CompareBranch compare_branches[] = {
+    {"eq", BR_EQ_INS}, {"lt", BR_LT_INS}, {"le", BR_LE_INS},
+    {"gt", BR_GT_INS}, {"ge", BR_GE_INS}
+};
+
+void fuse_compare_branches(Quicken* q, MethodValue* method, int* op_pos, int* op_tag) {
+    int n = method->code->size;
+    for (int j = 0; j < n; j++) {
+        if (op_tag[j] != CALL_SLOT_INS) continue;
+        CallSlotIns* call = vector_get(method->code, j);
+        int k = j + 1;
+        while (k < n && op_tag[k] < 0) k++;
+        if (k == n || op_tag[k] != BRANCH_INS || call->arity != 2) continue;
+        char* name = idx_to_str(q, call->name);
+        for (size_t c = 0; c < sizeof(compare_branches) / sizeof(CompareBranch); c++) {
+            if (strcmp(compare_branches[c].name, name) == 0) patch_op(q, op_pos[j], compare_branches[c].tag);
+        }
+    }
+}
+
 //---------------------------------------------------------------------------
 //--------------------------------process_propgramme-------------------------
 //---------------------------------------------------------------------------
 
-VMInfo* quicken_vm(Program* p) {
-    Quicken* q = init_quicken(p);
+VMInfo* quicken_vm(Program* p, void** handlers) {
+    Quicken* q = init_quicken(p, handlers);
     char* ip = process_programe(q);
     VMInfo* vm_info = create_vm_info(q, ip);
     free_quicken(q);
     return vm_info;
 }
 
-void write_frame (MethodValue* method, Code* code_buffer) {
-  check_size(code_buffer);
-  write_int(code_buffer, FRAME_INS);
-  write_int(code_buffer, method->nargs);
-  write_int(code_buffer, method->nlocals);
+// Only locals that may be read before they are written need a null; the
+// rest of the frame is left as is and hidden from the GC by the stack map.
+// The arguments are already on the stack, so only the locals are counted.
+void write_frame (Quicken* q, MethodValue* method, CFG* cfg) {
+  write_op(q, FRAME_INS);
+  write_short(q->code_buffer, method->nlocals);
+  write_short(q->code_buffer, max_stack_depth(cfg, q->program));
+  Vector* init = make_vector();
+  for (int i = method->nargs; i < method->nargs + method->nlocals; i++) {
+      if (cfg->nblocks > 0 && live_contains(cfg->blocks[0].live_in, i)) vector_add(init, (void*) (intptr_t) i);
+  }
+  write_short(q->code_buffer, init->size);
+  for (int i = 0; i < init->size; i++) {
+      write_short(q->code_buffer, (intptr_t) vector_get(init, i) - q->nvars);
+  }
+  vector_free(init);
+}
+
+void add_stack_map(Quicken* q, LiveSet live) {
+  StackMapEntry* entry = malloc(sizeof(StackMapEntry));
+  entry->code_idx = get_code_idx(q->code_buffer);
+  entry->nvars = q->nvars;
+  entry->live = live;
+  vector_add(q->stack_map, entry);
 }
 
 void* process_methods(Quicken* q) {
@@ -357,11 +690,30 @@ void* process_methods(Quicken* q) {
         Value* value = vector_get(q->program->values, i);
         if (value->tag == METHOD_VAL) {
             MethodValue* method = (MethodValue*) value;
-            add_int_entry(q, i, METHOD_ENTRY);
-            write_frame(method, q->code_buffer);
-            for (int j = 0; j < method->code->size; j++) {
-                parse_ops(q, (ByteIns*) vector_get(method->code, j));
+            CFG* cfg = build_cfg(method);
+            compute_liveness(cfg);
+            add_entry(q, i, METHOD_ENTRY);
+            q->nvars = method->nargs + method->nlocals;
+            q->leaf = q->global_use[method->name].leaf == i;
+            write_frame(q, method, cfg);
+            int n = method->code->size;
+            int* op_pos = malloc(sizeof(int) * (n + 1));
+            int* op_tag = malloc(sizeof(int) * (n + 1));
+            for (int j = 0; j < n; j++) {
+                ByteIns* ins = vector_get(method->code, j);
+                op_pos[j] = get_code_idx(q->code_buffer);
+                parse_ops(q, ins);
+                op_tag[j] = ins->tag == LABEL_OP ? -1 : (int) q->last_op;
+                if (cfg->live_after[j]) {
+                    add_stack_map(q, cfg->live_after[j]);
+                    cfg->live_after[j] = NULL;
+                }
             }
+            fuse_superinstructions(q, op_pos, op_tag, n);
+            fuse_compare_branches(q, method, op_pos, op_tag);
+            free(op_pos);
+            free(op_tag);
+            free_cfg(cfg);
         }
     }
 }
@@ -379,18 +731,18 @@ void* process_classes(Quicken* q) {
 
 void* process_globals(Quicken* q) {
     for (int i = 0; i < q->program->slots->size; i++) {
-        int idx = (int) vector_get(q->program->slots, i);
+        int idx = (intptr_t) vector_get(q->program->slots, i);
         Value* value = vector_get(q->program->values, idx);
         switch(value->tag) {
             case (METHOD_VAL): {
                 MethodValue* method = (MethodValue*) value;
-                Entry* entry = get_entry_by_int(q, idx);
-                link_entries_with_int(q, entry, method->name);
+                Entry* entry = get_entry(q, idx);
+                link_entries(q, entry, method->name);
                 break;
             }
             case (SLOT_VAL): {
                 SlotValue* svalue = (SlotValue*) value;
-                vector_add(q->globals, (void*) svalue->name);
+                add_global(q, svalue->name);
                 break;
             }
             default: {
@@ -407,21 +759,22 @@ void* process_patches(Quicken* q) {
         switch(patch->type) {
             case (LABEL_PATCH):
             case (FUNCTION_PATCH): {
-                Entry* entry = get_entry_by_int(q, patch->name);
-                ((void**)(q->code_buffer->code + patch->code_pos))[0] = q->code_buffer->code + entry->code_idx;
+                Entry* entry = get_entry(q, patch->name);
+                int offset = entry->code_idx - (patch->code_pos + (int) sizeof(int));
+                patch_int(q->code_buffer, patch->code_pos, offset);
                 break;
             } case(INT_PATCH): {
                 int idx = get_global_idx(q, patch->name);
-                ((int*)(q->code_buffer->code + patch->code_pos))[0] = idx;
+                patch_short(q->code_buffer, patch->code_pos, idx);
                 break;
             } case (CLASS_ARITY_PATCH): {
-                Entry* entry = get_entry_by_int(q, patch->name);
+                Entry* entry = get_entry(q, patch->name);
                 CClass* class = vector_get(q->classes, entry->class_idx);
-                ((short*)(q->code_buffer->code + patch->code_pos))[0] = class->nvars;
+                patch_short(q->code_buffer, patch->code_pos, class->nvars);
                 break;
             } case (CLASS_TAG_PATCH): {
-                Entry* entry = get_entry_by_int(q, patch->name);
-                ((short*)(q->code_buffer->code + patch->code_pos))[0] = entry->class_idx;
+                Entry* entry = get_entry(q, patch->name);
+                patch_short(q->code_buffer, patch->code_pos, entry->class_idx);
                 break;
             }
             default: {
@@ -432,11 +785,12 @@ void* process_patches(Quicken* q) {
 }
 
 char* process_programe(Quicken* q) {
+    analyse_globals(q);
     process_methods(q);
     // maybe just add idx to a vector, avoid a second loop.
     process_classes(q);
     process_globals(q);
     process_patches(q);
-    Entry* entry = get_entry_by_int(q, q->program->entry);
+    Entry* entry = get_entry(q, q->program->entry);
     return q->code_buffer->code + entry->code_idx;
 }
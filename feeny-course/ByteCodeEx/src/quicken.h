@@ -1,27 +1,50 @@
 #ifndef QUICKEN_H
 #define QUICKEN_H
 
+#include <stdint.h>
 #include "utils.h"
 #include "ht.h"
 #include "codebuffer.h"
+#include "cfg.h"
 
-typedef struct {
-    Vector* patch_buffer;
-    Vector* globals;
-    Program* program;
-    ht* hm;
-    Code* code_buffer;
-    Vector* classes;
-    Vector* const_pool;
-} Quicken;
+// Direct-threaded dispatch writes handler addresses instead of opcodes into
+// the code stream and relies on GCC's labels-as-values. Build with
+// -DSWITCH_DISPATCH to fall back to the portable switch loop.
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#define THREADED
+#endif
+
+#ifdef THREADED
+#define OP_SIZE sizeof(void*)
+#else
+#define OP_SIZE 1
+#endif
 
+// Every CALL_SLOT_INS carries an inline cache: a fill count followed by
+// IC_ENTRIES (shape, method code) pairs. Quicken writes it empty; the VM
+// fills it and moves the site from CALL_SLOT_INS to the MONO, POLY and
+// finally MEGA variants. A site whose first receiver is an int or an array
+// is rewritten to the builtin's own op instead, and goes back to
+// CALL_SLOT_INS when a later receiver fails its guard. Comparisons that
+// feed a BRANCH_OP start out as BR_*_INS sites and fall back the same way.
+#define IC_ENTRIES 4
+#define IC_ENTRY_SIZE (sizeof(int) + sizeof(void*))
+#define IC_SIZE (1 + IC_ENTRIES * IC_ENTRY_SIZE)
+
+// SLOT_INS and SET_SLOT_INS carry a monomorphic field cache keyed by the
+// receiver's shape, with the field's index and the parent depth it lives
+// at. Shapes are stored plus one so that a zeroed cache never hits. Build
+// with -DIC_STATS to count hits and misses per site and print them when
+// the program exits.
 typedef struct {
-    Code* code_buffer;
-    Vector* classes;
-    Vector* const_pool;
-    int globals_size;
-    char* ip;
-} VMInfo;
+    int shape;
+    short idx;
+    short depth;
+#ifdef IC_STATS
+    int hits;
+    int misses;
+#endif
+} SlotCache;
 
 typedef enum {
   INT_INS,        
@@ -41,10 +64,60 @@ typedef enum {
   GOTO_INS,       
   RETURN_INS,     
   DROP_INS,       
-  FRAME_INS       
+  FRAME_INS,
+  GET_GLOBAL_ONCE_INS,
+  CONST_INS,
+  SET_GLOBAL_ONCE_INS,
+  CALL_SLOT_MONO_INS,
+  CALL_SLOT_POLY_INS,
+  CALL_SLOT_MEGA_INS,
+  // Call sites that runvm quickens for an int or array receiver.
+  INT_ADD_INS,
+  INT_SUB_INS,
+  INT_MUL_INS,
+  INT_DIV_INS,
+  INT_MOD_INS,
+  INT_EQ_INS,
+  INT_LT_INS,
+  INT_LE_INS,
+  INT_GT_INS,
+  INT_GE_INS,
+  ARRAY_GET_INS,
+  ARRAY_SET_INS,
+  ARRAY_LENGTH_INS,
+  // Int comparisons fused with the BRANCH_INS that follows them.
+  BR_EQ_INS,
+  BR_LT_INS,
+  BR_LE_INS,
+  BR_GT_INS,
+  BR_GE_INS,
+  // Calls into and returns out of leaf functions, see find_leaf_functions.
+  CALL_LEAF_INS,
+  RETURN_LEAF_INS,
+  // Superinstructions, see superinstructions in quicken.c.
+  SET_LOCAL_DROP_GET_LOCAL_INT_INS,
+  SET_LOCAL_DROP_GET_LOCAL_INS,
+  DROP_GET_LOCAL_INT_INS,
+  SET_LOCAL_DROP_INS,
+  DROP_GET_LOCAL_INS,
+  GET_LOCAL_INT_INS,
+  GET_LOCAL_GET_LOCAL_INS
 } OpTag;
 
+// A PRINTF_OP format split at its '~'s into literal runs, with one
+// argument printed between each pair of runs.
+typedef struct {
+    int len;
+    char* text;
+} FormatRun;
+
+typedef struct {
+    int nruns;
+    FormatRun runs[];
+} Format;
+
 typedef enum {
+    NO_ENTRY,
     METHOD_ENTRY,
     LABEL_ENTRY,
     CLASS_ENTRY,
@@ -58,6 +131,80 @@ typedef struct {
     };
 } Entry;
 
+// Live frame slots at a safepoint, keyed by the code offset just past the
+// instruction: the resume address of a suspended caller, or the current ip
+// of the frame that triggered the collection.
+typedef struct {
+    int code_idx;
+    int nvars;
+    LiveSet live;
+} StackMapEntry;
+
+// Per-global facts gathered before any code is written. literal is the
+// constant pool id of the int/null a global is promoted to, or -1; once_id
+// indexes the write-once table, or -1; leaf is the constant pool id of the
+// leaf function the global names, or -1.
+typedef struct {
+    int nsets;
+    int read_early;
+    int literal;
+    int once_id;
+    int leaf;
+} GlobalUse;
+
+// A global written by a single SET_GLOBAL. After its first write every load
+// site is rewritten to push the value directly; a second write reverts them.
+typedef enum {
+    ONCE_UNSET,
+    ONCE_SET,
+    ONCE_INVALID
+} OnceState;
+
+typedef struct {
+    OnceState state;
+    int global;
+    Vector* sites;
+} OnceGlobal;
+
+typedef struct {
+    Vector* patch_buffer;
+    Vector* globals;
+    Program* program;
+    Entry* entries;
+    int* global_idx;
+    GlobalUse* global_use;
+    Vector* once_globals;
+    Code* code_buffer;
+    Vector* classes;
+    Vector* const_pool;
+    Vector* stack_map;
+    Vector* slot_sites;
+    Vector* formats;
+    ht* selector_ids;
+    Vector* selectors;
+    void** handlers;
+    // Arguments plus locals of the method being written. Locals are
+    // addressed below the frame pointer, so their offsets are idx - nvars.
+    int nvars;
+    // Whether the method being written is a leaf function.
+    int leaf;
+    // Opcode most recently written, read back by the superinstruction pass.
+    OpTag last_op;
+} Quicken;
+
+typedef struct {
+    Code* code_buffer;
+    Vector* classes;
+    Vector* const_pool;
+    Vector* stack_map;
+    Vector* once_globals;
+    Vector* slot_sites;
+    Vector* selectors;
+    Vector* formats;
+    int globals_size;
+    char* ip;
+} VMInfo;
+
 typedef enum {
     FUNCTION_PATCH,
     LABEL_PATCH,
@@ -80,18 +227,24 @@ typedef enum {
 typedef struct {
   SlotTag tag;
   char* name;
+  int sel;
   union {
     int idx;
     void* code;
   };
 } CSlot;
 
+// table maps (selector & mask) to an index into slots, or -1. make_class
+// grows it until every selector lands in its own bucket, so a lookup is a
+// single probe followed by one compare.
 typedef struct {
   int nvars;
   int nslots;
   CSlot* slots;
+  int mask;
+  short* table;
 } CClass;
 
-VMInfo* quicken_vm(Program* program);
+VMInfo* quicken_vm(Program* program, void** handlers);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,129 @@
+#include "simd.h"
+
+// Tagged words are 64 bits, so only x86-64 gets vector kernels.
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(NO_SIMD)
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+//---------------------------------------------------------------------------
+//--------------------------------scalar-------------------------------------
+//---------------------------------------------------------------------------
+
+static void fill_words_scalar(intptr_t* dst, intptr_t value, long n) {
+    for (long i = 0; i < n; i++) {
+        dst[i] = value;
+    }
+}
+
+static long find_word_scalar(intptr_t* src, intptr_t value, long n) {
+    for (long i = 0; i < n; i++) {
+        if (src[i] == value) return i;
+    }
+    return -1;
+}
+
+static int equal_words_scalar(intptr_t* a, intptr_t* b, long n) {
+    for (long i = 0; i < n; i++) {
+        if (a[i] != b[i]) return 0;
+    }
+    return 1;
+}
+
+void (*fill_words)(intptr_t* dst, intptr_t value, long n) = fill_words_scalar;
+long (*find_word)(intptr_t* src, intptr_t value, long n) = find_word_scalar;
+int (*equal_words)(intptr_t* a, intptr_t* b, long n) = equal_words_scalar;
+
+#ifdef X86_KERNELS
+
+//---------------------------------------------------------------------------
+//--------------------------------sse2---------------------------------------
+//---------------------------------------------------------------------------
+// SSE2 is part of x86-64, so these need no check. It has no 64-bit compare:
+// a word matches when both of its 32-bit halves do.
+
+static void fill_words_sse2(intptr_t* dst, intptr_t value, long n) {
+    __m128i v = _mm_set1_epi64x(value);
+    long i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_si128((__m128i*) (dst + i), v);
+    }
+    if (i < n) dst[i] = value;
+}
+
+static long find_word_sse2(intptr_t* src, intptr_t value, long n) {
+    __m128i v = _mm_set1_epi64x(value);
+    long i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((__m128i*) (src + i)), v);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    if (i < n && src[i] == value) return i;
+    return -1;
+}
+
+static int equal_words_sse2(intptr_t* a, intptr_t* b, long n) {
+    long i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*) (a + i)), _mm_loadu_si128((__m128i*) (b + i)));
+        if (_mm_movemask_epi8(eq) != 0xFFFF) return 0;
+    }
+    return i == n || a[i] == b[i];
+}
+
+//---------------------------------------------------------------------------
+//--------------------------------avx2---------------------------------------
+//---------------------------------------------------------------------------
+// The last 1 to 3 words go through the SSE2 kernels.
+
+__attribute__((target("avx2")))
+static void fill_words_avx2(intptr_t* dst, intptr_t value, long n) {
+    __m256i v = _mm256_set1_epi64x(value);
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_si256((__m256i*) (dst + i), v);
+    }
+    fill_words_sse2(dst + i, value, n - i);
+}
+
+__attribute__((target("avx2")))
+static long find_word_avx2(intptr_t* src, intptr_t value, long n) {
+    __m256i v = _mm256_set1_epi64x(value);
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((__m256i*) (src + i)), v);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    long j = find_word_sse2(src + i, value, n - i);
+    return j < 0 ? -1 : i + j;
+}
+
+__attribute__((target("avx2")))
+static int equal_words_avx2(intptr_t* a, intptr_t* b, long n) {
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i diff = _mm256_xor_si256(_mm256_loadu_si256((__m256i*) (a + i)), _mm256_loadu_si256((__m256i*) (b + i)));
+        if (!_mm256_testz_si256(diff, diff)) return 0;
+    }
+    return equal_words_sse2(a + i, b + i, n - i);
+}
+
+#endif
+
+void init_simd() {
+    #ifdef X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            fill_words = fill_words_avx2;
+            find_word = find_word_avx2;
+            equal_words = equal_words_avx2;
+        } else {
+            fill_words = fill_words_sse2;
+            find_word = find_word_sse2;
+            equal_words = equal_words_sse2;
+        }
+    #endif
+}
@@ -0,0 +1,17 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+
+// Kernels over runs of tagged words, used by ARRAY_INS and the bulk array
+// builtins. init_simd points them at AVX2 or SSE2 versions when the CPU has
+// them and leaves the plain C ones otherwise. Build with -DNO_SIMD to keep
+// the plain C ones everywhere.
+extern void (*fill_words)(intptr_t* dst, intptr_t value, long n);
+// Index of the first word equal to value, or -1.
+extern long (*find_word)(intptr_t* src, intptr_t value, long n);
+extern int (*equal_words)(intptr_t* a, intptr_t* b, long n);
+
+void init_simd();
+
+#endif
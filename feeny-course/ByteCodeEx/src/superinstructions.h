@@ -0,0 +1,11 @@
+// Rows for the superinstruction table in quicken.c, written by an
+// -DOP_STATS -DNO_SUPERINSTRUCTIONS build.
+// Run over tests/sudoku.feeny; GET_LOCAL_GET_LOCAL_GET_LOCAL has no handler
+// and was deleted.
+    {4, {SET_LOCAL_INS, DROP_INS, GET_LOCAL_INS, INT_INS}, SET_LOCAL_DROP_GET_LOCAL_INT_INS}, // saves 1067709 (15.7%)
+    {3, {DROP_INS, GET_LOCAL_INS, INT_INS}, DROP_GET_LOCAL_INT_INS}, // saves 1104246 (16.3%)
+    {3, {SET_LOCAL_INS, DROP_INS, GET_LOCAL_INS}, SET_LOCAL_DROP_GET_LOCAL_INS}, // saves 789998 (11.6%)
+    {2, {GET_LOCAL_INS, INT_INS}, GET_LOCAL_INT_INS}, // saves 821200 (12.1%)
+    {2, {DROP_INS, GET_LOCAL_INS}, DROP_GET_LOCAL_INS}, // saves 614974 (9.1%)
+    {2, {SET_LOCAL_INS, DROP_INS}, SET_LOCAL_DROP_INS}, // saves 448715 (6.6%)
+    {2, {GET_LOCAL_INS, GET_LOCAL_INS}, GET_LOCAL_GET_LOCAL_INS}, // saves 230010 (3.4%)
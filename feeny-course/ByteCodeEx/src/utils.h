@@ -24,5 +24,6 @@ void vector_free (Vector* v);
 void* vector_get (Vector* v, int i);
 void vector_set (Vector* v, int i, void* x);
 void vector_set_length (Vector* v, int len, void* x);
+void vector_ensure_capacity (Vector* v, int c);
 
 #endif
@@ -4,8 +4,6 @@
 //---------------------------------------------------------------------------
 //--------------------------------init_vm------------------------------------
 //---------------------------------------------------------------------------
-StackFrame* init_frame();
-void free_frame(StackFrame* stack_frame);
 void init_genv(VM* vm, int globals_size);
 void runvm (VM* vm);
 Heap* init_heap();
@@ -13,15 +11,38 @@ void free_heap(Heap* heap);
 intptr_t create_null();
 void int_function_call(VM* vm, char* name);
 void array_function_call(VM* vm, char* name);
+void print_slot_stats(VM* vm);
+void print_method_cache_stats(VM* vm);
+void print_op_stats(VM* vm);
+void flush_method_cache(VM* vm);
+void init_shapes(VM* vm);
+void free_shapes(VM* vm);
+void flush_output(VM* vm);
 
 VM* init_vm(VMInfo* vm_info) {
     VM* vm = malloc(sizeof(VM));
     vm->classes = vm_info->classes;
     vm->code_buffer = vm_info->code_buffer;
-    vm->fstack = init_frame();
-    vm->stack = make_vector();
+    vm->stack_map = vm_info->stack_map;
+    vm->once_globals = vm_info->once_globals;
+    vm->slot_sites = vm_info->slot_sites;
+    vm->selectors = vm_info->selectors;
+    vm->formats = vm_info->formats;
+    vm->method_cache = malloc(sizeof(MethodCacheEntry) * METHOD_CACHE_SIZE);
+    #ifdef OP_STATS
+        vm->op_stats = calloc(1, sizeof(OpStats));
+    #endif
+    flush_method_cache(vm);
+    init_shapes(vm);
+    vm->stack = malloc(sizeof(intptr_t) * STACK_INIT_SIZE);
+    vm->stack_limit = vm->stack + STACK_INIT_SIZE;
+    vm->sp = vm->stack;
+    vm->fp = vm->stack;
     vm->heap = init_heap();
     vm->null = create_null();
+    init_simd();
+    vm->out = malloc(OUTPUT_BUFFER_SIZE);
+    vm->out_len = 0;
     vm->ip = vm_info->ip;
     init_genv(vm, vm_info->globals_size);
     return vm;
@@ -38,17 +59,54 @@ void init_genv(VM* vm, int globals_size) {
 void free_vm(VM* vm) {
     vector_free(vm->classes);
     free_code_buffer(vm->code_buffer);
-    free_frame(vm->fstack);
-    vector_free(vm->stack);
+    for (int i = 0; i < vm->stack_map->size; i++) {
+        StackMapEntry* entry = vector_get(vm->stack_map, i);
+        free(entry->live);
+        free(entry);
+    }
+    vector_free(vm->stack_map);
+    for (int i = 0; i < vm->once_globals->size; i++) {
+        OnceGlobal* once = vector_get(vm->once_globals, i);
+        vector_free(once->sites);
+        free(once);
+    }
+    vector_free(vm->once_globals);
+    vector_free(vm->slot_sites);
+    vector_free(vm->selectors);
+    for (int i = 0; i < vm->formats->size; i++) {
+        free(vector_get(vm->formats, i));
+    }
+    vector_free(vm->formats);
+    free(vm->out);
+    free(vm->method_cache);
+    #ifdef OP_STATS
+        free(vm->op_stats);
+    #endif
+    free_shapes(vm);
+    free(vm->stack);
     free_heap(vm->heap);
     free(vm->genv);
     free(vm);
 }
 
+// Filled in by runvm(NULL) so quicken can thread handler addresses.
+void** op_handlers;
+
 void interpret_bc(Program* program) {
-    VMInfo* info = quicken_vm(program);
+    #ifdef THREADED
+        runvm(NULL);
+    #endif
+    VMInfo* info = quicken_vm(program, op_handlers);
     VM* vm = init_vm(info);
     runvm(vm);
+    flush_output(vm);
+    #ifdef IC_STATS
+        print_slot_stats(vm);
+        print_method_cache_stats(vm);
+    #endif
+    #ifdef OP_STATS
+        print_op_stats(vm);
+    #endif
     free_vm(vm);
 }
 
@@ -58,13 +116,172 @@ void interpret_bc(Program* program) {
 //===================== Classes ==================================================
 //---------------------------------------------------------------------------
 
-CSlot get_slot(VM* vm, VMObj* obj, char* name) {
-    CClass* class = vector_get(vm->classes, obj->tag);
-    for (int i = 0; i < class->nslots; i++) {
-        CSlot slot = class->slots[i];
-        if (strcmp(name, slot.name) == 0) return slot;
+char* selector_name(VM* vm, int sel) {
+    return vector_get(vm->selectors, sel);
+}
+
+// Walks the parent chain with one probe into each class's slot table. depth
+// counts the parent links followed before the slot was found.
+CSlot walk_slot(VM* vm, VMObj* obj, int sel, int* depth) {
+    *depth = 0;
+    while (obj && obj->tag != VM_ARRAY) {
+        CClass* class = vector_get(vm->classes, obj->tag);
+        int i = class->table[sel & class->mask];
+        if (i >= 0 && class->slots[i].sel == sel) return class->slots[i];
+        obj = obj->parent;
+        (*depth)++;
+    }
+    flush_output(vm);
+    printf("No slot named %s.\n", selector_name(vm, sel));
+    exit(-1);
+}
+
+//---------------------------------------------------------------------------
+//--------------------------------shapes-------------------------------------
+//---------------------------------------------------------------------------
+// Parents are fixed when an object is built, so an object's shape is
+// interned once from its class tag and its parent's shape. Everything a
+// lookup depends on is then summed up by one id.
+#define SHAPE_INDEX_INIT 64
+#define SHAPE_MEMO_INIT 8
+
+void init_shapes(VM* vm) {
+    vm->shapes = make_vector();
+    vm->shape_index_mask = SHAPE_INDEX_INIT - 1;
+    vm->shape_index = calloc(SHAPE_INDEX_INIT, sizeof(int));
+}
+
+void free_shapes(VM* vm) {
+    for (int i = 0; i < vm->shapes->size; i++) {
+        Shape* shape = vector_get(vm->shapes, i);
+        free(shape->memo);
+        free(shape);
     }
-    return get_slot(vm, obj->parent, name);
+    vector_free(vm->shapes);
+    free(vm->shape_index);
+}
+
+// Buckets in the index hold shape id + 1, and 0 when empty.
+int shape_bucket(VM* vm, int* index, int mask, int tag, int parent) {
+    int i = (tag * 31 + parent) & mask;
+    while (index[i]) {
+        Shape* shape = vector_get(vm->shapes, index[i] - 1);
+        if (shape->tag == tag && shape->parent == parent) break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+void grow_shape_index(VM* vm) {
+    int mask = vm->shape_index_mask * 2 + 1;
+    int* index = calloc(mask + 1, sizeof(int));
+    for (int id = 0; id < vm->shapes->size; id++) {
+        Shape* shape = vector_get(vm->shapes, id);
+        index[shape_bucket(vm, index, mask, shape->tag, shape->parent)] = id + 1;
+    }
+    free(vm->shape_index);
+    vm->shape_index = index;
+    vm->shape_index_mask = mask;
+}
+
+int intern_shape(VM* vm, int tag, int parent) {
+    int i = shape_bucket(vm, vm->shape_index, vm->shape_index_mask, tag, parent);
+    if (vm->shape_index[i]) return vm->shape_index[i] - 1;
+    Shape* shape = malloc(sizeof(Shape));
+    shape->tag = tag;
+    shape->parent = parent;
+    shape->memo_size = 0;
+    shape->memo_mask = SHAPE_MEMO_INIT - 1;
+    shape->memo = malloc(sizeof(ShapeSlot) * SHAPE_MEMO_INIT);
+    for (int k = 0; k < SHAPE_MEMO_INIT; k++) {
+        shape->memo[k].sel = -1;
+    }
+    vector_add(vm->shapes, shape);
+    vm->shape_index[i] = vm->shapes->size;
+    if (vm->shapes->size * 2 > vm->shape_index_mask + 1) grow_shape_index(vm);
+    return vm->shapes->size - 1;
+}
+
+ShapeSlot* memo_bucket(ShapeSlot* memo, int mask, int sel) {
+    int i = sel & mask;
+    while (memo[i].sel >= 0 && memo[i].sel != sel) {
+        i = (i + 1) & mask;
+    }
+    return &memo[i];
+}
+
+void grow_memo(Shape* shape) {
+    int mask = shape->memo_mask * 2 + 1;
+    ShapeSlot* memo = malloc(sizeof(ShapeSlot) * (mask + 1));
+    for (int k = 0; k <= mask; k++) {
+        memo[k].sel = -1;
+    }
+    for (int k = 0; k <= shape->memo_mask; k++) {
+        if (shape->memo[k].sel >= 0) *memo_bucket(memo, mask, shape->memo[k].sel) = shape->memo[k];
+    }
+    free(shape->memo);
+    shape->memo = memo;
+    shape->memo_mask = mask;
+}
+
+// The first lookup of a selector on a shape walks the chain; the answer is
+// then shared by every object with that shape.
+CSlot find_slot(VM* vm, VMObj* obj, int sel, int* depth) {
+    Shape* shape = vector_get(vm->shapes, obj->shape);
+    ShapeSlot* entry = memo_bucket(shape->memo, shape->memo_mask, sel);
+    if (entry->sel == sel) {
+        *depth = entry->depth;
+        return entry->slot;
+    }
+    CSlot slot = walk_slot(vm, obj, sel, depth);
+    entry->sel = sel;
+    entry->depth = *depth;
+    entry->slot = slot;
+    shape->memo_size++;
+    if (shape->memo_size * 2 > shape->memo_mask + 1) grow_memo(shape);
+    return slot;
+}
+
+//---------------------------------------------------------------------------
+//--------------------------------method cache-------------------------------
+//---------------------------------------------------------------------------
+
+int method_cache_hash(int shape, int sel) {
+    return ((shape << 5) ^ sel) & (METHOD_CACHE_SIZE - 1);
+}
+
+// Classes never change after quickening, so a flush is only needed to start
+// from a clean cache.
+void flush_method_cache(VM* vm) {
+    memset(vm->method_cache, 0, sizeof(MethodCacheEntry) * METHOD_CACHE_SIZE);
+    memset(&vm->method_cache_stats, 0, sizeof(MethodCacheStats));
+}
+
+// Entries store shape + 1 so that a flushed entry never matches.
+CSlot get_slot(VM* vm, VMObj* obj, int sel, int* depth) {
+    MethodCacheEntry* entry = &vm->method_cache[method_cache_hash(obj->shape, sel)];
+    if (entry->shape == obj->shape + 1 && entry->sel == sel) {
+        #ifdef IC_STATS
+            vm->method_cache_stats.hits++;
+        #endif
+        *depth = entry->depth;
+        return entry->slot;
+    }
+    #ifdef IC_STATS
+        vm->method_cache_stats.misses++;
+        if (entry->shape) vm->method_cache_stats.collisions++;
+    #endif
+    CSlot slot = find_slot(vm, obj, sel, depth);
+    entry->shape = obj->shape + 1;
+    entry->sel = sel;
+    entry->depth = *depth;
+    entry->slot = slot;
+    return slot;
+}
+
+VMObj* get_parent(VMObj* obj, int depth) {
+    while (depth-- > 0) obj = obj->parent;
+    return obj;
 }
 
 //---------------------------------------------------------------------------
@@ -79,12 +296,63 @@ typedef enum {
 
 static const intptr_t tagMask = 7;
 
-intptr_t create_int(int value) {
-    return (intptr_t) value << 3;
+// Ints are 61 bits wide and stored shifted left over a zero tag.
+intptr_t create_int(intptr_t value) {
+    return (intptr_t) ((uintptr_t) value << 3);
+}
+
+intptr_t get_int(intptr_t value) {
+    return value >> 3;
+}
+
+void int_overflow(VM* vm) {
+    flush_output(vm);
+    printf("Integer overflow.\n");
+    exit(-1);
+}
+
+void int_div_by_zero(VM* vm) {
+    flush_output(vm);
+    printf("Division by zero.\n");
+    exit(-1);
+}
+
+// With a zero tag add and sub work on the tagged words directly and mul
+// only has to untag one side, so the hardware overflow check on the
+// tagged result is also the check for the 61-bit range.
+static inline intptr_t int_add(VM* vm, intptr_t x, intptr_t y) {
+    intptr_t r;
+    if (__builtin_add_overflow(x, y, &r)) int_overflow(vm);
+    return r;
 }
 
-int get_int(intptr_t value) {
-    return (int) value >> 3;
+static inline intptr_t int_sub(VM* vm, intptr_t x, intptr_t y) {
+    intptr_t r;
+    if (__builtin_sub_overflow(x, y, &r)) int_overflow(vm);
+    return r;
+}
+
+static inline intptr_t int_mul(VM* vm, intptr_t x, intptr_t y) {
+    intptr_t r;
+    if (__builtin_mul_overflow(x, y >> 3, &r)) int_overflow(vm);
+    return r;
+}
+
+// The tags cancel in the quotient; only the most negative int divided by
+// -1 leaves the range.
+static inline intptr_t int_div(VM* vm, intptr_t x, intptr_t y) {
+    intptr_t r;
+    if (y == 0) int_div_by_zero(vm);
+    if (__builtin_mul_overflow(x / y, 8, &r)) int_overflow(vm);
+    return r;
+}
+
+// The remainder is in range, but the hardware traps on the most negative
+// int mod -1 as it does on the quotient.
+static inline intptr_t int_mod(VM* vm, intptr_t x, intptr_t y) {
+    if (y == 0) int_div_by_zero(vm);
+    if (y == create_int(-1)) return 0;
+    return x % y;
 }
 
 intptr_t create_null() {
@@ -108,75 +376,543 @@ int get_tag_value(intptr_t value) {
 //===================== VM ==================================================
 //---------------------------------------------------------------------------
 
-unsigned char next_char (VM* vm) {
-  unsigned char c = vm->ip[0];
-  vm->ip++;
+// The readers advance whichever ip they are given: runvm's local copy, or
+// vm->ip outside the interpreter loop.
+unsigned char next_char (char** ip) {
+  unsigned char c = (*ip)[0];
+  (*ip)++;
   return c;
 }
 
-int next_short (VM* vm) {
-  vm->ip = (char*)(((long)vm->ip + 1)&(-2));
-  int s = ((unsigned short*)vm->ip)[0];  
-  vm->ip += 2;
+int next_short (char** ip) {
+  unsigned short s;
+  memcpy(&s, *ip, sizeof(unsigned short));
+  *ip += sizeof(unsigned short);
   return s;
 }
 
-int next_int (VM* vm) {
-  vm->ip = (char*)(((long)vm->ip + 3)&(-4));
-  int s = ((int*)vm->ip)[0];  
-  vm->ip += 4;
+// Local offsets are relative to the frame pointer and negative.
+int next_local (char** ip) {
+  short s;
+  memcpy(&s, *ip, sizeof(short));
+  *ip += sizeof(short);
   return s;
 }
 
-void* next_ptr (VM* vm) {
-  vm->ip = (char*)(((long)vm->ip + 7)&(-8));
-  void* s = ((void**)vm->ip)[0];  
-  vm->ip += 8;
+int next_int (char** ip) {
+  int s;
+  memcpy(&s, *ip, sizeof(int));
+  *ip += sizeof(int);
   return s;
 }
 
-void* format_print(VM* vm, char* string, int nargs) {
-    int i = 0;
-    while (*string != '\0') {
-        if (*string == '~') {
-            printf("%d", get_int((intptr_t) vector_get(vm->stack, vm->stack->size - nargs + i)));
-            string++;
-            i++;
+void* next_ptr (char** ip) {
+  void* s;
+  memcpy(&s, *ip, sizeof(void*));
+  *ip += sizeof(void*);
+  return s;
+}
+
+char* next_label (char** ip) {
+  int offset = next_int(ip);
+  return *ip + offset;
+}
+
+//---------------------------------------------------------------------------
+//--------------------------------output-------------------------------------
+//---------------------------------------------------------------------------
+
+void flush_output(VM* vm) {
+    fwrite(vm->out, 1, vm->out_len, stdout);
+    vm->out_len = 0;
+}
+
+void write_output(VM* vm, char* text, int len) {
+    if (vm->out_len + len > OUTPUT_BUFFER_SIZE) {
+        flush_output(vm);
+        if (len > OUTPUT_BUFFER_SIZE) {
+            fwrite(text, 1, len, stdout);
+            return;
         }
-        printf("%c", *string);
-        string++;
     }
-    for (int i = 0; i < nargs; i++) {
-        vector_pop(vm->stack);
+    memcpy(vm->out + vm->out_len, text, len);
+    vm->out_len += len;
+}
+
+void write_int_output(VM* vm, intptr_t value) {
+    char digits[24];
+    char* p = digits + sizeof(digits);
+    uintptr_t n = value < 0 ? -(uintptr_t) value : (uintptr_t) value;
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    if (value < 0) *--p = '-';
+    write_output(vm, p, digits + sizeof(digits) - p);
+}
+
+void format_print(VM* vm, Format* format, int nargs) {
+    intptr_t* args = vm->sp - nargs;
+    write_output(vm, format->runs[0].text, format->runs[0].len);
+    for (int i = 1; i < format->nruns; i++) {
+        write_int_output(vm, get_int(args[i - 1]));
+        write_output(vm, format->runs[i].text, format->runs[i].len);
+    }
+    vm->sp -= nargs;
+}
+
+//---------------------------------------------------------------------------
+//--------------------------------operand stack------------------------------
+//---------------------------------------------------------------------------
+
+void push(VM* vm, intptr_t value) {
+    *vm->sp++ = value;
+}
+
+intptr_t pop(VM* vm) {
+    return *--vm->sp;
+}
+
+// Called once per frame entry with the method's maximum stack depth, so the
+// instructions themselves never check for overflow.
+void ensure_stack(VM* vm, int depth) {
+    if (vm->sp + depth <= vm->stack_limit) return;
+    long used = vm->sp - vm->stack;
+    long fp = vm->fp - vm->stack;
+    long size = vm->stack_limit - vm->stack;
+    while (used + depth > size) size *= 2;
+    vm->stack = realloc(vm->stack, sizeof(intptr_t) * size);
+    vm->stack_limit = vm->stack + size;
+    vm->sp = vm->stack + used;
+    vm->fp = vm->stack + fp;
+}
+
+//---------------------------------------------------------------------------
+//--------------------------------frames-------------------------------------
+//---------------------------------------------------------------------------
+
+// The arguments are already the top operands of the caller and become the
+// first locals in place; the remaining locals are reserved by bumping sp
+// without clearing them. Quicken lists the locals that may be read before
+// they are written; every other slot stays unscanned until the stack map
+// says it is live. A NULL return ip marks the entry frame.
+// ip, sp and fp are runvm's registers, passed by reference so they can stay
+// in locals; they only go through the VM when the stack has to grow.
+// sp of a frame with no operands. With the tos cache the first push writes
+// the stale register to the spill word at fp + 2; without it, operands
+// start past that word and it is never written.
+#ifdef NO_TOS_CACHE
+  #define FRAME_SP 3
+#else
+  #define FRAME_SP 2
+#endif
+
+static inline void add_frame(VM* vm, char** ip, intptr_t** sp, intptr_t** fp, char* ret) {
+    int nlocals = next_short(ip);
+    int max_stack = next_short(ip);
+    int ninit = next_short(ip);
+    if (*sp + nlocals + 3 + max_stack > vm->stack_limit) {
+        vm->sp = *sp;
+        vm->fp = *fp;
+        ensure_stack(vm, nlocals + 3 + max_stack);
+        *sp = vm->sp;
+        *fp = vm->fp;
+    }
+    intptr_t* new_fp = *sp + nlocals;
+    for (int i = 0; i < ninit; i++) {
+        new_fp[next_local(ip)] = vm->null;
+    }
+    new_fp[0] = *fp - vm->stack;
+    new_fp[1] = (intptr_t) ret;
+    *fp = new_fp;
+    *sp = new_fp + FRAME_SP;
+}
+
+// code points at the callee's FRAME_INS, which is entered here directly.
+static inline void push_call(VM* vm, char* code, char** ip, intptr_t** sp, intptr_t** fp) {
+    char* ret = *ip;
+    *ip = code + OP_SIZE;
+    add_frame(vm, ip, sp, fp, ret);
+}
+
+// Leaf functions have no locals to reserve or clear, and their frame is
+// only walked if one of their call sites reaches a method, so entering one
+// only checks the stack and skips the saved fp and return ip; runvm holds
+// those until RETURN_LEAF_INS or CALL_METHOD. Returns the caller's fp,
+// which may have moved if the stack grew.
+static inline intptr_t* push_leaf_call(VM* vm, char* code, char** ip, intptr_t** sp, intptr_t** fp) {
+    char* header = code + OP_SIZE + sizeof(short);
+    int max_stack = next_short(&header);
+    if (*sp + 3 + max_stack > vm->stack_limit) {
+        vm->sp = *sp;
+        vm->fp = *fp;
+        ensure_stack(vm, 3 + max_stack);
+        *sp = vm->sp;
+        *fp = vm->fp;
     }
+    intptr_t* caller = *fp;
+    *ip = header + sizeof(short);
+    *fp = *sp;
+    *sp += FRAME_SP;
+    return caller;
 }
 
 //---------------------------------------------------------------------------
-//--------------------------------StackFrame------------------------------------
+//--------------------------------write-once globals-------------------------
 //---------------------------------------------------------------------------
+// Load sites are laid out as [op][short idx][value], so specialising or
+// reverting a site only rewrites its opcode and value in place.
+void set_site_op(char* site, OpTag tag) {
+    #ifdef THREADED
+        memcpy(site, &op_handlers[tag], sizeof(void*));
+    #else
+        *site = tag;
+    #endif
+}
 
+void set_site_value(char* site, intptr_t value) {
+    memcpy(site + OP_SIZE + sizeof(short), &value, sizeof(intptr_t));
+}
 
-StackFrame* init_frame() {
-    StackFrame* frame = malloc(sizeof(StackFrame));
-    frame->stack = make_vector();
-    frame->fp = 0;
+void update_once_sites(VM* vm, OnceGlobal* once, OpTag tag) {
+    intptr_t value = vm->genv[once->global];
+    for (int i = 0; i < once->sites->size; i++) {
+        char* site = vm->code_buffer->code + (intptr_t) vector_get(once->sites, i);
+        set_site_op(site, tag);
+        set_site_value(site, value);
+    }
 }
 
-void free_frame(StackFrame* stack_frame) {
-    vector_free(stack_frame->stack);
-    free(stack_frame);
+void set_global_once(VM* vm, int idx, int once_id) {
+    OnceGlobal* once = vector_get(vm->once_globals, once_id);
+    once->global = idx;
+    if (once->state == ONCE_UNSET) {
+        once->state = ONCE_SET;
+        update_once_sites(vm, once, CONST_INS);
+    } else if (once->state == ONCE_SET) {
+        once->state = ONCE_INVALID;
+        update_once_sites(vm, once, GET_GLOBAL_ONCE_INS);
+    }
 }
 
-void add_frame(VM* vm) {
-    int nargs = next_int(vm);
-    int nlocals = next_int(vm);
-    vm->fstack->fp = (vm->fstack->stack->size > 0) ? vm->fstack->stack->size - 2 : 0; //size = 9, fp = 7
-    vector_set_length(vm->fstack->stack, vm->fstack->stack->size + nargs + nlocals, (void*) vm->null);
-    for (int i = nargs; i > 0; i--) {
-        vector_set(vm->fstack->stack, vm->fstack->fp + 1 + i, vector_pop(vm->stack));
+// The GC moves the objects that specialised sites point at.
+void scan_once_globals(VM* vm) {
+    for (int i = 0; i < vm->once_globals->size; i++) {
+        OnceGlobal* once = vector_get(vm->once_globals, i);
+        if (once->state == ONCE_SET) update_once_sites(vm, once, CONST_INS);
     }
 }
 
+//---------------------------------------------------------------------------
+//--------------------------------call-slot caches---------------------------
+//---------------------------------------------------------------------------
+// Entries are keyed by shape + 1, so inherited methods are cached as well.
+
+int ic_shape(char* ic, int i) {
+    int shape;
+    memcpy(&shape, ic + 1 + i * IC_ENTRY_SIZE, sizeof(int));
+    return shape;
+}
+
+void* ic_code(char* ic, int i) {
+    void* code;
+    memcpy(&code, ic + 1 + i * IC_ENTRY_SIZE + sizeof(int), sizeof(void*));
+    return code;
+}
+
+void ic_add(char* site, char* ic, int shape, void* code) {
+    int size = ic[0];
+    if (size == IC_ENTRIES) {
+        set_site_op(site, CALL_SLOT_MEGA_INS);
+        return;
+    }
+    memcpy(ic + 1 + size * IC_ENTRY_SIZE, &shape, sizeof(int));
+    memcpy(ic + 1 + size * IC_ENTRY_SIZE + sizeof(int), &code, sizeof(void*));
+    ic[0] = size + 1;
+    set_site_op(site, size == 0 ? CALL_SLOT_MONO_INS : CALL_SLOT_POLY_INS);
+}
+
+// Shape + 1 of an object receiver, or 0 for ints, null and arrays.
+int receiver_shape(intptr_t ptr) {
+    if (get_tag_value(ptr) != OBJ_PTAG) return 0;
+    VMObj* obj = (VMObj*) get_obj(ptr);
+    if (obj->tag == VM_ARRAY) return 0;
+    return obj->shape + 1;
+}
+
+typedef struct {
+    char* name;
+    int arity;
+    OpTag tag;
+} BuiltinOp;
+
+static BuiltinOp int_ops[] = {
+    {"add", 2, INT_ADD_INS}, {"sub", 2, INT_SUB_INS}, {"mul", 2, INT_MUL_INS},
+    {"div", 2, INT_DIV_INS}, {"mod", 2, INT_MOD_INS}, {"eq", 2, INT_EQ_INS},
+    {"lt", 2, INT_LT_INS}, {"le", 2, INT_LE_INS}, {"gt", 2, INT_GT_INS},
+    {"ge", 2, INT_GE_INS}
+};
+
+static BuiltinOp array_ops[] = {
+    {"get", 2, ARRAY_GET_INS}, {"set", 3, ARRAY_SET_INS},
+    {"length", 1, ARRAY_LENGTH_INS}
+};
+
+int is_array(intptr_t ptr) {
+    return get_tag_value(ptr) == OBJ_PTAG && get_obj(ptr)->tag == VM_ARRAY;
+}
+
+static inline void store_element(VMArray* array, long i, intptr_t value) {
+    if (get_tag_value(value) == OBJ_PTAG) array->kind = GENERIC_ELEMENTS;
+    array->items[i] = value;
+}
+
+// Rewrites a CALL_SLOT_INS site to the builtin op for its first receiver,
+// if there is one. Object receivers are left to ic_add.
+void quicken_call(VM* vm, char* site, int arity, int sel, intptr_t receiver) {
+    BuiltinOp* ops;
+    int nops;
+    if (get_tag_value(receiver) == INT_PTAG) {
+        ops = int_ops;
+        nops = sizeof(int_ops) / sizeof(BuiltinOp);
+    } else if (is_array(receiver)) {
+        ops = array_ops;
+        nops = sizeof(array_ops) / sizeof(BuiltinOp);
+    } else {
+        return;
+    }
+    char* name = selector_name(vm, sel);
+    for (int i = 0; i < nops; i++) {
+        if (ops[i].arity == arity && strcmp(ops[i].name, name) == 0) {
+            set_site_op(site, ops[i].tag);
+            return;
+        }
+    }
+}
+
+// Full call-slot dispatch. Builtins run on vm->sp and return NULL; for an
+// object receiver the method is returned for runvm to enter. A NULL ic means
+// the site has gone megamorphic.
+char* call_slot(VM* vm, char* site, char* ic, int arity, int sel) {
+    intptr_t ptr = vm->sp[-arity];
+    switch(get_tag_value(ptr)) {
+        case INT_PTAG: {
+            int_function_call(vm, selector_name(vm, sel));
+            break;
+        } case NULL_PTAG: {
+            flush_output(vm);
+            printf("No slots can be called on null value");
+            exit(-1); 
+        } case OBJ_PTAG: {
+            VMValue* value = get_obj(ptr);
+            switch(value->tag) {
+                case VM_ARRAY: {
+                    array_function_call(vm, selector_name(vm, sel));
+                    break;
+                }
+                default : {
+                    VMObj* obj = (VMObj*) value;
+                    int depth;
+                    CSlot slot = get_slot(vm, obj, sel, &depth);
+                    if (ic) ic_add(site, ic, obj->shape + 1, slot.code);
+                    return slot.code;
+                }
+            }   
+        }
+    }
+    return NULL;
+}
+
+//---------------------------------------------------------------------------
+//--------------------------------slot caches--------------------------------
+//---------------------------------------------------------------------------
+
+intptr_t* slot_ref(VM* vm, VMObj* obj, int sel, char* site_cache) {
+    SlotCache cache;
+    memcpy(&cache, site_cache, sizeof(SlotCache));
+    if (obj->shape + 1 == cache.shape) {
+        #ifdef IC_STATS
+            cache.hits++;
+            memcpy(site_cache, &cache, sizeof(SlotCache));
+        #endif
+        return &get_parent(obj, cache.depth)->slots[cache.idx];
+    }
+    int depth;
+    CSlot slot = get_slot(vm, obj, sel, &depth);
+    cache.shape = obj->shape + 1;
+    cache.idx = slot.idx;
+    cache.depth = depth;
+    #ifdef IC_STATS
+        cache.misses++;
+    #endif
+    memcpy(site_cache, &cache, sizeof(SlotCache));
+    return &get_parent(obj, depth)->slots[slot.idx];
+}
+
+#ifdef IC_STATS
+void print_method_cache_stats(VM* vm) {
+    MethodCacheStats* stats = &vm->method_cache_stats;
+    printf("method cache: %ld hits, %ld misses, %ld collisions\n", stats->hits, stats->misses, stats->collisions);
+}
+
+void print_slot_stats(VM* vm) {
+    for (int i = 0; i < vm->slot_sites->size; i++) {
+        char* site_cache = vm->code_buffer->code + (int) vector_get(vm->slot_sites, i);
+        unsigned short sel;
+        SlotCache cache;
+        memcpy(&sel, site_cache - sizeof(short), sizeof(short));
+        memcpy(&cache, site_cache, sizeof(SlotCache));
+        int total = cache.hits + cache.misses;
+        if (total == 0) continue;
+        printf("slot site %d (%s): %d hits, %d misses, %.1f%%\n", (int) vector_get(vm->slot_sites, i),
+               selector_name(vm, sel), cache.hits, cache.misses, 100.0 * cache.hits / total);
+    }
+}
+#endif
+
+//---------------------------------------------------------------------------
+//--------------------------------op stats-----------------------------------
+//---------------------------------------------------------------------------
+// The n-grams that save the most dispatches are printed, and the best ones a
+// fused handler could run are written to SUPERINSTRUCTIONS_FILE as rows for
+// the superinstruction table in quicken.c.
+#ifdef OP_STATS
+static const char* op_names[] = {
+    "INT_INS", "NULL_INS", "PRINTF_INS", "ARRAY_INS", "OBJECT_INS",
+    "SLOT_INS", "SET_SLOT_INS", "CALL_SLOT_INS", "CALL_INS",
+    "SET_LOCAL_INS", "GET_LOCAL_INS", "SET_GLOBAL_INS",
+    "GET_GLOBAL_INS", "BRANCH_INS", "GOTO_INS", "RETURN_INS",
+    "DROP_INS", "FRAME_INS", "GET_GLOBAL_ONCE_INS", "CONST_INS",
+    "SET_GLOBAL_ONCE_INS", "CALL_SLOT_MONO_INS", "CALL_SLOT_POLY_INS",
+    "CALL_SLOT_MEGA_INS", "INT_ADD_INS", "INT_SUB_INS", "INT_MUL_INS",
+    "INT_DIV_INS", "INT_MOD_INS", "INT_EQ_INS", "INT_LT_INS", "INT_LE_INS",
+    "INT_GT_INS", "INT_GE_INS", "ARRAY_GET_INS", "ARRAY_SET_INS",
+    "ARRAY_LENGTH_INS", "BR_EQ_INS", "BR_LT_INS", "BR_LE_INS", "BR_GT_INS",
+    "BR_GE_INS", "CALL_LEAF_INS", "RETURN_LEAF_INS",
+    "SET_LOCAL_DROP_GET_LOCAL_INT_INS",
+    "SET_LOCAL_DROP_GET_LOCAL_INS", "DROP_GET_LOCAL_INT_INS",
+    "SET_LOCAL_DROP_INS", "DROP_GET_LOCAL_INS", "GET_LOCAL_INT_INS",
+    "GET_LOCAL_GET_LOCAL_INS"
+};
+
+#define NGRAM_SHOWN 20
+#define SUPERINSTRUCTION_ROWS 8
+#define SUPERINSTRUCTIONS_FILE "superinstructions.h"
+
+int handler_tag(void* handler) {
+    int tag = 0;
+    while (op_handlers[tag] != handler) tag++;
+    return tag;
+}
+
+void count_ngram(OpStats* stats, int key) {
+    int i = (key * 2654435761u) & (NGRAM_TABLE_SIZE - 1);
+    while (stats->table[i].key && stats->table[i].key != key) {
+        i = (i + 1) & (NGRAM_TABLE_SIZE - 1);
+    }
+    stats->table[i].key = key;
+    stats->table[i].count++;
+}
+
+void count_op(VM* vm, int tag) {
+    OpStats* stats = vm->op_stats;
+    stats->dispatches++;
+    memmove(stats->recent + 1, stats->recent, sizeof(int) * (NGRAM_MAX - 1));
+    stats->recent[0] = tag;
+    if (stats->nrecent < NGRAM_MAX) stats->nrecent++;
+    int tags = 0;
+    for (int n = 1; n <= stats->nrecent; n++) {
+        tags |= stats->recent[n - 1] << (6 * (n - 1));
+        count_ngram(stats, (tags << 3) | n);
+    }
+}
+
+long ngram_saved(NGram* gram) {
+    return ((gram->key & 7) - 1) * gram->count;
+}
+
+int compare_ngrams(const void* a, const void* b) {
+    long x = ngram_saved((NGram*) a);
+    long y = ngram_saved((NGram*) b);
+    return (x < y) - (x > y);
+}
+
+// Ops whose handlers neither jump nor rewrite their own op slot, so a fused
+// handler can run them back to back.
+int fusable_op(int tag) {
+    switch (tag) {
+        case INT_INS:
+        case NULL_INS:
+        case SET_LOCAL_INS:
+        case GET_LOCAL_INS:
+        case DROP_INS:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int fusable_ngram(NGram* gram) {
+    for (int k = 0; k < (gram->key & 7); k++) {
+        if (!fusable_op((gram->key >> (3 + 6 * k)) & 63)) return 0;
+    }
+    return 1;
+}
+
+// The fused tag is named after its ops, with their _INS suffixes dropped.
+void print_superinstruction(FILE* out, NGram* gram, long dispatches) {
+    int n = gram->key & 7;
+    fprintf(out, "    {%d, {", n);
+    for (int k = n - 1; k >= 0; k--) {
+        fprintf(out, "%s%s", k == n - 1 ? "" : ", ", op_names[(gram->key >> (3 + 6 * k)) & 63]);
+    }
+    fprintf(out, "}, ");
+    for (int k = n - 1; k >= 0; k--) {
+        const char* name = op_names[(gram->key >> (3 + 6 * k)) & 63];
+        fprintf(out, "%.*s_", (int) strlen(name) - 4, name);
+    }
+    fprintf(out, "INS}, // saves %ld (%.1f%%)\n", ngram_saved(gram), 100.0 * ngram_saved(gram) / dispatches);
+}
+
+// grams is sorted by dispatches saved; the rows are written longest first,
+// as quicken takes the first row that matches.
+void write_superinstructions(NGram* grams, int ngrams, long dispatches) {
+    FILE* out = fopen(SUPERINSTRUCTIONS_FILE, "w");
+    if (!out) {
+        printf("Could not write %s.\n", SUPERINSTRUCTIONS_FILE);
+        return;
+    }
+    fprintf(out, "// Rows for the superinstruction table in quicken.c, written by an\n");
+    fprintf(out, "// -DOP_STATS -DNO_SUPERINSTRUCTIONS build.\n");
+    for (int n = NGRAM_MAX; n > 1; n--) {
+        int rows = 0;
+        for (int i = 0; i < ngrams; i++) {
+            if (!fusable_ngram(&grams[i])) continue;
+            if (++rows > SUPERINSTRUCTION_ROWS) break;
+            if ((grams[i].key & 7) == n) print_superinstruction(out, &grams[i], dispatches);
+        }
+    }
+    fclose(out);
+    printf("wrote %s\n", SUPERINSTRUCTIONS_FILE);
+}
+
+void print_op_stats(VM* vm) {
+    OpStats* stats = vm->op_stats;
+    NGram* grams = malloc(sizeof(NGram) * NGRAM_TABLE_SIZE);
+    int ngrams = 0;
+    for (int i = 0; i < NGRAM_TABLE_SIZE; i++) {
+        if ((stats->table[i].key & 7) > 1) grams[ngrams++] = stats->table[i];
+    }
+    qsort(grams, ngrams, sizeof(NGram), compare_ngrams);
+    printf("dispatches: %ld\n", stats->dispatches);
+    for (int i = 0; i < ngrams && i < NGRAM_SHOWN; i++) {
+        print_superinstruction(stdout, &grams[i], stats->dispatches);
+    }
+    write_superinstructions(grams, ngrams, stats->dispatches);
+    free(grams);
+}
+#endif
+
 //---------------------------------------------------------------------------
 //--------------------------------heap------------------------------------
 //---------------------------------------------------------------------------
@@ -204,8 +940,11 @@ void free_heap(Heap* heap) {
     free(heap);
 }
 
+// runvm bumps a local copy of heap->sp itself and only comes here, with its
+// registers spilled, when the heap is full.
 void* halloc (VM* vm, long tag, int sz) {
   if(vm->heap->sp + sz > vm->heap->head){
+      flush_output(vm);
       printf("Calling GC.\n");
       run_gc(vm);
       if(vm->heap->sp + sz > vm->heap->head) {
@@ -219,16 +958,6 @@ void* halloc (VM* vm, long tag, int sz) {
   return obj;
 }
 
-VMArray* create_array(VM* vm, intptr_t length) {
-    int int_length = get_int(length);
-    VMArray* array = (VMArray*) halloc(vm, VM_ARRAY, sizeof(VMArray) + sizeof(void*) * int_length);
-    array->length = int_length;
-    return array;
-}
-
-VMObj* create_object(VM* vm, int class, int arity) {
-  VMObj* obj = halloc(vm, class, sizeof(VMObj) + sizeof(void*) * arity);
-}
 //---------------------------------------------------------------------------
 //--------------------------------run gc------------------------------------
 //---------------------------------------------------------------------------
@@ -287,23 +1016,42 @@ intptr_t get_post_gc_ptr(VM* vm, intptr_t obj_ptr) {
     }
 }
 
-void scan_stack(VM* vm) {
-    for (int i = 0; i < vm->stack->size; i++) {
-        intptr_t new_obj = get_post_gc_ptr(vm, (intptr_t) vector_get(vm->stack, i));
-        vector_set(vm->stack, i, (void*) new_obj);
+StackMapEntry* find_stack_map(VM* vm, char* ip) {
+    int code_idx = ip - vm->code_buffer->code;
+    int lo = 0;
+    int hi = vm->stack_map->size - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        StackMapEntry* entry = vector_get(vm->stack_map, mid);
+        if (entry->code_idx == code_idx) return entry;
+        if (entry->code_idx < code_idx) lo = mid + 1;
+        else hi = mid - 1;
     }
+    flush_output(vm);
+    printf("No stack map at code offset %d.\n", code_idx);
+    exit(-1);
 }
 
-void scan_stack_frame(VM* vm) {
-    int frame_start = vm->fstack->fp + 2;
-    int frame_end = vm->fstack->stack->size;
-    while (frame_end > 0) {
-        for (int i = frame_start; i < frame_end; i++) {
-            intptr_t new_obj = get_post_gc_ptr(vm, (intptr_t) vector_get(vm->fstack->stack, i));
-            vector_set(vm->fstack->stack, i, (void*) new_obj);
+// Each frame is scanned with the stack map of the ip it is suspended at: the
+// current ip for the top frame, the saved return address for its callers.
+// Operands are always scanned, locals only when the map says they are live.
+void scan_stack(VM* vm) {
+    intptr_t* fp = vm->fp;
+    intptr_t* top = vm->sp;
+    char* ip = vm->ip;
+    while (1) {
+        StackMapEntry* map = find_stack_map(vm, ip);
+        for (intptr_t* p = fp + 3; p < top; p++) {
+            *p = get_post_gc_ptr(vm, *p);
+        }
+        intptr_t* locals = fp - map->nvars;
+        for (int i = 0; i < map->nvars; i++) {
+            if (live_contains(map->live, i)) locals[i] = get_post_gc_ptr(vm, locals[i]);
         }
-        frame_end = frame_start - 2;
-        frame_start = ((int) vector_get(vm->fstack->stack, frame_start - 2)) + 2;
+        ip = (char*) fp[1];
+        if (ip == NULL) break;
+        top = locals;
+        fp = vm->stack + fp[0];
     }
 }
 
@@ -315,7 +1063,6 @@ void scan_globals(VM* vm) {
 
 void scan_root_set(VM* vm) {
     scan_stack(vm);
-    scan_stack_frame(vm);
     scan_globals(vm);
 }
 
@@ -327,7 +1074,7 @@ void scan_array(VM* vm, VMArray* array) {
 
 void scan_object(VM* vm, VMObj* obj) {
     CClass* class = vector_get(vm->classes, obj->tag);
-    obj->parent = get_obj(get_post_gc_ptr(vm, set_obj_bit((VMValue*) obj->parent)));
+    if (obj->parent) obj->parent = get_obj(get_post_gc_ptr(vm, set_obj_bit((VMValue*) obj->parent)));
     for (int i = 0; i < class->nvars; i++) {
         obj->slots[i] = get_post_gc_ptr(vm, (intptr_t) obj->slots[i]);
     }
@@ -342,7 +1089,7 @@ void scan_heap(VM* vm) {
             case VM_NULL:
                 break;
             case VM_ARRAY:
-                scan_array(vm, (VMArray*) value);
+                if (((VMArray*) value)->kind == GENERIC_ELEMENTS) scan_array(vm, (VMArray*) value);
                 break;
             default:
                 scan_object(vm, (VMObj*) value);
@@ -357,247 +1104,679 @@ void run_gc(VM* vm) {
     switch_heap(vm->heap);
     scan_root_set(vm);
     scan_heap(vm);
+    scan_once_globals(vm);
 }
 
 //---------------------------------------------------------------------------
 //--------------------------------run vm------------------------------------
 //---------------------------------------------------------------------------
 
-void runvm (VM* vm) {  
-  while (vm->ip) {
-    int tag = next_int(vm);
-    #ifdef DEBUG
-        printf("STACK: ");
-        for (int i = 0; i < vm->stack->size; i++) {
-            intptr_t value = (intptr_t) vector_get(vm->stack, i);
-            switch(get_tag_value(value)) {
-                case INT_PTAG: 
-                    printf("int: %d, ", get_int(value));
-                    break;
-                case NULL_PTAG:
-                    printf("null, ");
-                    break;
-                case OBJ_PTAG:
-                    VMValue* value2 = get_obj(value);
-                    switch(value2->tag) {
-                        case VM_ARRAY:
-                            VMArray* array = (VMArray*) value2;
-                            printf("(");
-                            for(int i = 0; i < array->length; i++) {
-                                printf("%d, ", get_int(array->items[i]));
-                            }
-                            printf(")");
-                            break;
-                        default :{
-                            VMObj* obj = (VMObj*) value2;
-                            printf("Class #%ld", obj->tag);
+#ifdef DEBUG
+void print_stack (VM* vm) {
+    printf("STACK: ");
+    for (intptr_t* p = vm->fp + 3; p < vm->sp; p++) {
+        intptr_t value = *p;
+        switch(get_tag_value(value)) {
+            case INT_PTAG: 
+                printf("int: %ld, ", get_int(value));
+                break;
+            case NULL_PTAG:
+                printf("null, ");
+                break;
+            case OBJ_PTAG:
+                VMValue* value2 = get_obj(value);
+                switch(value2->tag) {
+                    case VM_ARRAY:
+                        VMArray* array = (VMArray*) value2;
+                        printf("(");
+                        for(int i = 0; i < array->length; i++) {
+                            printf("%ld, ", get_int(array->items[i]));
                         }
+                        printf(")");
+                        break;
+                    default :{
+                        VMObj* obj = (VMObj*) value2;
+                        printf("Class #%ld", obj->tag);
                     }
-                    break;
                 }
+                break;
+            }
+    }
+    printf("\n");
+}
+#endif
+
+// runvm keeps ip, sp, fp, the heap bump pointer and the top operand in
+// locals. sp points past the operands below tos, so the stack in memory is
+// only complete after SPILL(). Builtins and printf only see the stack, so
+// just sp and tos are spilled around them; the GC and stack growth see
+// everything. Build with -DNO_TOS_CACHE to keep every operand in memory;
+// SPILL() and FILL() then do nothing.
+#ifdef NO_TOS_CACHE
+  #define TOS (sp[-1])
+  #define NOS (sp[-2])
+  #define THIRD (sp[-3])
+  #define PUSH(x) (*sp++ = (intptr_t) (x))
+  #define DROP() (sp--)
+  #define SPILL() ((void) 0)
+  #define FILL() ((void) 0)
+  #define RETURN_SP(base) ((base)[0] = TOS, sp = (base) + 1)
+#else
+  #define TOS tos
+  #define NOS (sp[-1])
+  #define THIRD (sp[-2])
+  #define PUSH(x) (*sp++ = tos, tos = (intptr_t) (x))
+  #define DROP() (tos = *--sp)
+  #define SPILL() (*sp++ = tos)
+  #define FILL() (tos = *--sp)
+  // The result stays in tos.
+  #define RETURN_SP(base) (sp = (base))
+#endif
+#define SAVE_SP() (SPILL(), vm->sp = sp)
+#define LOAD_SP() (sp = vm->sp, FILL())
+#define SAVE_STATE() (SPILL(), vm->ip = ip, vm->sp = sp, vm->fp = fp, vm->heap->sp = hp)
+#define LOAD_STATE() (ip = vm->ip, sp = vm->sp, fp = vm->fp, hp = vm->heap->sp, FILL())
+
+#define ALLOC(obj, tag, sz) do { \
+    if (hp + (sz) <= vm->heap->head) { \
+        obj = (void*) hp; \
+        *(long*) hp = (tag); \
+        hp += (sz); \
+    } else { \
+        SAVE_STATE(); \
+        obj = halloc(vm, (tag), (sz)); \
+        LOAD_STATE(); \
+    } \
+} while (0)
+
+// A running leaf whose call site reaches a method rather than a builtin
+// first writes the saved fp and return ip it skipped, so the GC can walk it
+// and RETURN_LEAF_INS returns through them like RETURN_INS.
+#define CALL_METHOD(code) do { \
+    if (leaf_ret) { \
+        fp[0] = leaf_fp - vm->stack; \
+        fp[1] = (intptr_t) leaf_ret; \
+        leaf_ret = NULL; \
+    } \
+    push_call(vm, (code), &ip, &sp, &fp); \
+} while (0)
+
+// Call sites spill tos first so that the arguments are in memory, ready to
+// become the callee's frame.
+#define SLOW_CALL(site, ic, arity, sel) do { \
+    vm->sp = sp; \
+    char* code = call_slot(vm, (site), (ic), (arity), (sel)); \
+    sp = vm->sp; \
+    if (code) CALL_METHOD(code); \
+    else FILL(); \
+} while (0)
+
+// Quickened call sites keep the CALL_SLOT_INS operands, so a failed guard
+// can put the generic op back and make the call the slow way.
+#define BUILTIN_SITE() \
+    char* site = ip - OP_SIZE; \
+    int arity = next_short(&ip); \
+    int sel = next_short(&ip); \
+    char* ic = ip; \
+    ip += IC_SIZE
+
+#define DEOPT_CALL() do { \
+    set_site_op(site, CALL_SLOT_INS); \
+    SPILL(); \
+    SLOW_CALL(site, ic, arity, sel); \
+} while (0)
+
+// Only the receiver is checked, as in int_function_call.
+#define INT_OP(tag, result) \
+        OP(tag) : { \
+            BUILTIN_SITE(); \
+            if (get_tag_value(NOS) != INT_PTAG) { \
+                DEOPT_CALL(); \
+                NEXT(); \
+            } \
+            intptr_t x = NOS; \
+            intptr_t y = TOS; \
+            sp--; \
+            TOS = (result); \
+            NEXT(); \
+        }
+
+// Pops both operands and takes the BRANCH_INS behind the call site when
+// cond holds. A non-int receiver makes the call instead and leaves the
+// result for that BRANCH_INS.
+#define COMPARE_BRANCH(tag, cond) \
+        OP(tag) : { \
+            BUILTIN_SITE(); \
+            if (get_tag_value(NOS) != INT_PTAG) { \
+                DEOPT_CALL(); \
+                NEXT(); \
+            } \
+            intptr_t x = NOS; \
+            intptr_t y = TOS; \
+            sp--; \
+            DROP(); \
+            SKIP_OP(); \
+            char* target = next_label(&ip); \
+            if (cond) ip = target; \
+            NEXT(); \
         }
-        printf("\n");
+
+// In threaded mode every handler ends in its own indirect jump through the
+// handler address that quicken wrote in place of the opcode. Cross-jumping
+// would fold the identical tails of similar handlers, such as the BR_*_INS
+// family and BRANCH_INS, back into one shared jump, so it is turned off for
+// runvm.
+#ifdef THREADED
+  #define RUNVM_ATTRIBUTES __attribute__((optimize("no-crossjumping")))
+  #if defined(DEBUG)
+    #define NEXT() do { SAVE_STATE(); print_stack(vm); LOAD_STATE(); goto *next_ptr(&ip); } while (0)
+  #elif defined(OP_STATS)
+    #define NEXT() do { void* handler = next_ptr(&ip); count_op(vm, handler_tag(handler)); goto *handler; } while (0)
+  #else
+    #define NEXT() goto *next_ptr(&ip)
+  #endif
+  #define OP(tag) L_##tag
+#else
+  #define RUNVM_ATTRIBUTES
+  #define NEXT() break
+  #define OP(tag) case tag
+#endif
+
+// Superinstructions leave the opcodes they replace in the code stream.
+#define SKIP_OP() (ip += OP_SIZE)
+
+RUNVM_ATTRIBUTES void runvm (VM* vm) {
+  #ifdef THREADED
+  static void* handlers[] = {
+    &&L_INT_INS, &&L_NULL_INS, &&L_PRINTF_INS, &&L_ARRAY_INS, &&L_OBJECT_INS,
+    &&L_SLOT_INS, &&L_SET_SLOT_INS, &&L_CALL_SLOT_INS, &&L_CALL_INS,
+    &&L_SET_LOCAL_INS, &&L_GET_LOCAL_INS, &&L_SET_GLOBAL_INS,
+    &&L_GET_GLOBAL_INS, &&L_BRANCH_INS, &&L_GOTO_INS, &&L_RETURN_INS,
+    &&L_DROP_INS, &&L_FRAME_INS, &&L_GET_GLOBAL_ONCE_INS, &&L_CONST_INS,
+    &&L_SET_GLOBAL_ONCE_INS, &&L_CALL_SLOT_MONO_INS, &&L_CALL_SLOT_POLY_INS,
+    &&L_CALL_SLOT_MEGA_INS, &&L_INT_ADD_INS, &&L_INT_SUB_INS, &&L_INT_MUL_INS,
+    &&L_INT_DIV_INS, &&L_INT_MOD_INS, &&L_INT_EQ_INS, &&L_INT_LT_INS,
+    &&L_INT_LE_INS, &&L_INT_GT_INS, &&L_INT_GE_INS, &&L_ARRAY_GET_INS,
+    &&L_ARRAY_SET_INS, &&L_ARRAY_LENGTH_INS, &&L_BR_EQ_INS, &&L_BR_LT_INS,
+    &&L_BR_LE_INS, &&L_BR_GT_INS, &&L_BR_GE_INS, &&L_CALL_LEAF_INS,
+    &&L_RETURN_LEAF_INS,
+    &&L_SET_LOCAL_DROP_GET_LOCAL_INT_INS,
+    &&L_SET_LOCAL_DROP_GET_LOCAL_INS, &&L_DROP_GET_LOCAL_INT_INS,
+    &&L_SET_LOCAL_DROP_INS, &&L_DROP_GET_LOCAL_INS, &&L_GET_LOCAL_INT_INS,
+    &&L_GET_LOCAL_GET_LOCAL_INS
+  };
+  if (vm == NULL) {
+    op_handlers = handlers;
+    return;
+  }
+  char* ip = vm->ip;
+  intptr_t* sp = vm->sp;
+  intptr_t* fp = vm->fp;
+  char* hp = vm->heap->sp;
+  #ifndef NO_TOS_CACHE
+  intptr_t tos = vm->null;
+  #endif
+  char* leaf_ret = NULL;
+  intptr_t* leaf_fp = NULL;
+  NEXT();
+  #else
+  char* ip = vm->ip;
+  intptr_t* sp = vm->sp;
+  intptr_t* fp = vm->fp;
+  char* hp = vm->heap->sp;
+  #ifndef NO_TOS_CACHE
+  intptr_t tos = vm->null;
+  #endif
+  char* leaf_ret = NULL;
+  intptr_t* leaf_fp = NULL;
+  while (ip) {
+    int tag = next_char(&ip);
+    #ifdef OP_STATS
+        count_op(vm, tag);
+    #endif
+    #ifdef DEBUG
+        SAVE_STATE();
+        print_stack(vm);
+        LOAD_STATE();
     #endif
     switch (tag) {
-        case INT_INS : {
-            int i = next_int(vm);
+  #endif
+        OP(INT_INS) : {
+            int i = next_int(&ip);
             intptr_t value = create_int(i);
             #ifdef DEBUG
                 printf("int ins val: %d\n", i);
             #endif
-            vector_add(vm->stack, (void*) value);
-            break;
+            PUSH(value);
+            NEXT();
         }
-        case NULL_INS : {
+        OP(NULL_INS) : {
             #ifdef DEBUG
                 printf("null ins\n");
             #endif
             intptr_t value = vm->null;
-            vector_add(vm->stack, (void*) value);
-            break;
+            PUSH(value);
+            NEXT();
         }
-        case PRINTF_INS : {
-            int nargs = next_int(vm);
-            char* str = next_ptr(vm);
+        OP(PRINTF_INS) : {
+            int nargs = next_short(&ip);
+            Format* format = next_ptr(&ip);
             #ifdef DEBUG
-                printf("print: %d and str: %s\n", nargs, str);
+                printf("print: %d and runs: %d\n", nargs, format->nruns);
             #endif
-            format_print(vm, str, nargs);
-            vector_add(vm->stack, (void*) vm->null);
-            break;
+            SAVE_SP();
+            format_print(vm, format, nargs);
+            LOAD_SP();
+            #ifdef DEBUG
+                flush_output(vm);
+            #endif
+            PUSH(vm->null);
+            NEXT();
         }
-        case ARRAY_INS : {
+        OP(ARRAY_INS) : {
             #ifdef DEBUG
                 printf("array\n");
             #endif
-            intptr_t length = (intptr_t) vector_get(vm->stack, vm->stack->size - 2);
-            VMArray* array = create_array(vm, length);
-            intptr_t initial = (intptr_t) vector_pop(vm->stack);
-            vector_pop(vm->stack);
-            for (int i = 0; i < array->length; i++) {
-                array->items[i] = initial;
-            }
-            vector_add(vm->stack, (void*) set_obj_bit((VMValue*) array));
-            break;
+            int length = get_int(NOS);
+            VMArray* array;
+            ALLOC(array, VM_ARRAY, sizeof(VMArray) + sizeof(void*) * length);
+            array->length = length;
+            intptr_t initial = TOS;
+            array->kind = get_tag_value(initial) == OBJ_PTAG ? GENERIC_ELEMENTS : IMMEDIATE_ELEMENTS;
+            DROP();
+            fill_words(array->items, initial, array->length);
+            TOS = set_obj_bit((VMValue*) array);
+            NEXT();
         }
-        case OBJECT_INS: {
-            int arity = next_int(vm);
-            int class = next_int(vm);
+        OP(OBJECT_INS) : {
+            int arity = next_short(&ip);
+            int class = next_short(&ip);
             #ifdef DEBUG
                 printf("object \n");
             #endif
-            VMObj* obj = create_object(vm, class, arity);
+            VMObj* obj;
+            ALLOC(obj, class, sizeof(VMObj) + sizeof(void*) * arity);
             for (int i = arity - 1; i >= 0; i--) {
-                obj->slots[i] = vector_pop(vm->stack);
+                obj->slots[i] = TOS;
+                DROP();
             }
-            intptr_t parent_ptr = (intptr_t) vector_pop(vm->stack);
-            obj->parent = (VMObj*) get_obj(parent_ptr);
-            vector_add(vm->stack, (void*) set_obj_bit((VMValue*) obj));
-            break;
+            intptr_t parent_ptr = TOS;
+            VMObj* parent = get_tag_value(parent_ptr) == OBJ_PTAG ? (VMObj*) get_obj(parent_ptr) : NULL;
+            obj->parent = parent;
+            obj->shape = intern_shape(vm, class, (parent && parent->tag != VM_ARRAY) ? parent->shape : -1);
+            TOS = set_obj_bit((VMValue*) obj);
+            NEXT();
         }
-        case SLOT_INS: {
-            char* name = next_ptr(vm);
-            intptr_t obj = (intptr_t) vector_pop(vm->stack);
-            VMObj* vm_obj = (VMObj*) get_obj(obj);
-            CSlot slot = get_slot(vm, vm_obj, name);
-            vector_add(vm->stack, (void*) vm_obj->slots[slot.idx]);
-            break;
+        OP(SLOT_INS) : {
+            int sel = next_short(&ip);
+            char* cache = ip;
+            ip += sizeof(SlotCache);
+            VMObj* vm_obj = (VMObj*) get_obj(TOS);
+            TOS = *slot_ref(vm, vm_obj, sel, cache);
+            NEXT();
         }
-        case SET_SLOT_INS: {
-            char* name = next_ptr(vm);
-            intptr_t value = (intptr_t) vector_pop(vm->stack);
-            intptr_t obj =  (intptr_t) vector_pop(vm->stack);
-            VMObj* vm_obj = (VMObj*) get_obj(obj);
-            CSlot slot = get_slot(vm, vm_obj, name);
-            vm_obj->slots[slot.idx] = value;
-            vector_add(vm->stack, (void*) value);
-            break;
+        OP(SET_SLOT_INS) : {
+            int sel = next_short(&ip);
+            char* cache = ip;
+            ip += sizeof(SlotCache);
+            intptr_t value = TOS;
+            DROP();
+            VMObj* vm_obj = (VMObj*) get_obj(TOS);
+            *slot_ref(vm, vm_obj, sel, cache) = value;
+            TOS = value;
+            NEXT();
         }
-        case CALL_SLOT_INS: {
-            int arity = next_int(vm);
-            char* name = next_ptr(vm);
+        OP(CALL_SLOT_INS) : {
+            char* site = ip - OP_SIZE;
+            int arity = next_short(&ip);
+            int sel = next_short(&ip);
+            char* ic = ip;
+            ip += IC_SIZE;
             #ifdef DEBUG
-                printf("call-op #%d and str: %s\n", arity, name);
+                printf("call-op #%d and str: %s\n", arity, selector_name(vm, sel));
             #endif
-            intptr_t ptr = (intptr_t) vector_get(vm->stack, vm->stack->size - arity);
-            switch(get_tag_value(ptr)) {
-                case INT_PTAG: {
-                    int_function_call(vm, name);
-                    break;
-                } case NULL_PTAG: {
-                    printf("No slots can be called on null value");
-                    exit(-1); 
-                } case OBJ_PTAG: {
-                    VMValue* value = get_obj(ptr);
-                    switch(value->tag) {
-                        case VM_ARRAY: {
-                            array_function_call(vm, name);
-                            break;
-                        }
-                        default : {
-                            VMObj* obj = (VMObj*) value;
-                            CSlot slot = get_slot(vm, obj, name);
-                            vector_add(vm->fstack->stack, (void*) vm->fstack->fp);
-                            vector_add(vm->fstack->stack, vm->ip);
-                            vm->ip = slot.code;
-                            break;
-                        }
-                    }   
-                }
+            SPILL();
+            quicken_call(vm, site, arity, sel, sp[-arity]);
+            SLOW_CALL(site, ic, arity, sel);
+            NEXT();
+        }
+        OP(CALL_SLOT_MONO_INS) : {
+            char* site = ip - OP_SIZE;
+            int arity = next_short(&ip);
+            int sel = next_short(&ip);
+            char* ic = ip;
+            ip += IC_SIZE;
+            SPILL();
+            intptr_t ptr = sp[-arity];
+            if (receiver_shape(ptr) == ic_shape(ic, 0)) {
+                CALL_METHOD(ic_code(ic, 0));
+            } else {
+                SLOW_CALL(site, ic, arity, sel);
             }
-            break;
+            NEXT();
         }
-        case CALL_INS : {
-            int arity = next_int(vm);
-            void* new_code = next_ptr(vm);
+        OP(CALL_SLOT_POLY_INS) : {
+            char* site = ip - OP_SIZE;
+            int arity = next_short(&ip);
+            int sel = next_short(&ip);
+            char* ic = ip;
+            ip += IC_SIZE;
+            SPILL();
+            int shape = receiver_shape(sp[-arity]);
+            int i = 0;
+            while (i < ic[0] && ic_shape(ic, i) != shape) i++;
+            if (i < ic[0]) {
+                CALL_METHOD(ic_code(ic, i));
+            } else {
+                SLOW_CALL(site, ic, arity, sel);
+            }
+            NEXT();
+        }
+        OP(CALL_SLOT_MEGA_INS) : {
+            int arity = next_short(&ip);
+            int sel = next_short(&ip);
+            ip += IC_SIZE;
+            SPILL();
+            SLOW_CALL(NULL, NULL, arity, sel);
+            NEXT();
+        }
+        INT_OP(INT_ADD_INS, int_add(vm, x, y))
+        INT_OP(INT_SUB_INS, int_sub(vm, x, y))
+        INT_OP(INT_MUL_INS, int_mul(vm, x, y))
+        INT_OP(INT_DIV_INS, int_div(vm, x, y))
+        INT_OP(INT_MOD_INS, int_mod(vm, x, y))
+        INT_OP(INT_EQ_INS, x == y ? create_int(1) : vm->null)
+        INT_OP(INT_LT_INS, x < y ? create_int(1) : vm->null)
+        INT_OP(INT_LE_INS, x <= y ? create_int(1) : vm->null)
+        INT_OP(INT_GT_INS, x > y ? create_int(1) : vm->null)
+        INT_OP(INT_GE_INS, x >= y ? create_int(1) : vm->null)
+        COMPARE_BRANCH(BR_EQ_INS, x == y)
+        COMPARE_BRANCH(BR_LT_INS, x < y)
+        COMPARE_BRANCH(BR_LE_INS, x <= y)
+        COMPARE_BRANCH(BR_GT_INS, x > y)
+        COMPARE_BRANCH(BR_GE_INS, x >= y)
+        OP(ARRAY_GET_INS) : {
+            BUILTIN_SITE();
+            if (!is_array(NOS)) {
+                DEOPT_CALL();
+                NEXT();
+            }
+            VMArray* array = (VMArray*) get_obj(NOS);
+            intptr_t i = TOS;
+            sp--;
+            TOS = array->items[get_int(i)];
+            NEXT();
+        }
+        OP(ARRAY_SET_INS) : {
+            BUILTIN_SITE();
+            if (!is_array(THIRD)) {
+                DEOPT_CALL();
+                NEXT();
+            }
+            VMArray* array = (VMArray*) get_obj(THIRD);
+            store_element(array, get_int(NOS), TOS);
+            sp -= 2;
+            TOS = vm->null;
+            NEXT();
+        }
+        OP(ARRAY_LENGTH_INS) : {
+            BUILTIN_SITE();
+            if (!is_array(TOS)) {
+                DEOPT_CALL();
+                NEXT();
+            }
+            VMArray* array = (VMArray*) get_obj(TOS);
+            TOS = create_int(array->length);
+            NEXT();
+        }
+        OP(CALL_INS) : {
+            #ifdef DEBUG
+                int arity = next_short(&ip);
+            #else
+                ip += sizeof(short);
+            #endif
+            void* new_code = next_label(&ip);
             #ifdef DEBUG
                 printf("calls #%d and ptr: %p\n", arity, new_code);
             #endif
-            vector_add(vm->fstack->stack, (void*) vm->fstack->fp);
-            vector_add(vm->fstack->stack, vm->ip);
-            vm->ip = new_code;
-            break;
+            SPILL();
+            push_call(vm, new_code, &ip, &sp, &fp);
+            NEXT();
         }
-        case SET_LOCAL_INS : {
-            int idx = next_int(vm);
+        // Only one leaf can be running at a time, as leaves make no calls.
+        OP(CALL_LEAF_INS) : {
             #ifdef DEBUG
-                printf("set local : %d at: %d\n", idx, vm->fstack->fp + 2 + idx);
+                int arity = next_short(&ip);
+            #else
+                ip += sizeof(short);
             #endif
-            vector_set(vm->fstack->stack, vm->fstack->fp + 2 + idx, vector_peek(vm->stack));
-            break;
+            char* new_code = next_label(&ip);
+            #ifdef DEBUG
+                printf("calls leaf #%d and ptr: %p\n", arity, new_code);
+            #endif
+            SPILL();
+            leaf_ret = ip;
+            leaf_fp = push_leaf_call(vm, new_code, &ip, &sp, &fp);
+            NEXT();
         }
-        case GET_LOCAL_INS : {
-            int idx = next_int(vm);
+        OP(SET_LOCAL_INS) : {
+            int idx = next_local(&ip);
+            #ifdef DEBUG
+                printf("set local : %d\n", idx);
+            #endif
+            fp[idx] = TOS;
+            NEXT();
+        }
+        OP(GET_LOCAL_INS) : {
+            int idx = next_local(&ip);
             #ifdef DEBUG
                 printf("get local : %d\n", idx);
             #endif
-            vector_add(vm->stack, vector_get(vm->fstack->stack, vm->fstack->fp + 2 + idx));
-            break;
+            PUSH(fp[idx]);
+            NEXT();
         }
-        case SET_GLOBAL_INS : {
-            int idx = next_int(vm);
+        OP(SET_GLOBAL_INS) : {
+            int idx = next_short(&ip);
             #ifdef DEBUG
                 printf("set global : %d\n", idx);
             #endif
-            vm->genv[idx] = vector_peek(vm->stack);
-            break;
+            vm->genv[idx] = TOS;
+            NEXT();
         }
-        case GET_GLOBAL_INS : {
-            int idx = next_int(vm);
+        OP(GET_GLOBAL_INS) : {
+            int idx = next_short(&ip);
             #ifdef DEBUG
                 printf("get global : %d\n", idx);
             #endif
-            vector_add(vm->stack, (void*) vm->genv[idx]);
-            break;
+            PUSH(vm->genv[idx]);
+            NEXT();
+        }
+        OP(SET_GLOBAL_ONCE_INS) : {
+            int idx = next_short(&ip);
+            int once_id = next_short(&ip);
+            #ifdef DEBUG
+                printf("set global once : %d\n", idx);
+            #endif
+            vm->genv[idx] = TOS;
+            set_global_once(vm, idx, once_id);
+            NEXT();
         }
-        case BRANCH_INS : {
-            void* new_ptr = next_ptr(vm);
-            intptr_t value = (intptr_t) vector_pop(vm->stack);
+        OP(GET_GLOBAL_ONCE_INS) : {
+            int idx = next_short(&ip);
+            ip += sizeof(intptr_t);
+            #ifdef DEBUG
+                printf("get global once : %d\n", idx);
+            #endif
+            PUSH(vm->genv[idx]);
+            NEXT();
+        }
+        OP(CONST_INS) : {
+            ip += sizeof(short);
+            void* value = next_ptr(&ip);
+            #ifdef DEBUG
+                printf("const : %p\n", value);
+            #endif
+            PUSH(value);
+            NEXT();
+        }
+        OP(BRANCH_INS) : {
+            void* new_ptr = next_label(&ip);
+            intptr_t value = TOS;
+            DROP();
             #ifdef DEBUG
                 printf("branch tag: %d, ptr: %p\n", get_tag_value(value), new_ptr);
             #endif
-            if(get_tag_value(value) != NULL_PTAG) vm->ip = new_ptr;
-            break;
+            if(get_tag_value(value) != NULL_PTAG) ip = new_ptr;
+            NEXT();
         }
-        case GOTO_INS : {
-            void* ptr = next_ptr(vm);
+        OP(GOTO_INS) : {
+            void* ptr = next_label(&ip);
             #ifdef DEBUG
                 printf("goto ins, ptr: %p\n", ptr);
             #endif
-            vm->ip = ptr;
-            break;
+            ip = ptr;
+            NEXT();
         }
-        case RETURN_INS : {
+        OP(RETURN_INS) : {
             #ifdef DEBUG
                 printf("return ins\n");
             #endif
-            if (vm->fstack->stack->size == 0) return;
-            int old_fp = (int) vector_get(vm->fstack->stack, vm->fstack->fp);
-            vm->ip = vector_get(vm->fstack->stack, vm->fstack->fp + 1); 
-            vector_set_length(vm->fstack->stack, vm->fstack->fp, (void*) vm->null);
-            vm->fstack->fp = old_fp;
-            break;
+            int nvars = next_short(&ip);
+            char* ret = (char*) fp[1];
+            if (ret == NULL) {
+                SAVE_STATE();
+                return;
+            }
+            // With no arguments or locals the result lands on the saved fp,
+            // so the caller's frame is restored first.
+            intptr_t* base = fp - nvars;
+            fp = vm->stack + fp[0];
+            ip = ret;
+            RETURN_SP(base);
+            NEXT();
+        }
+        OP(RETURN_LEAF_INS) : {
+            #ifdef DEBUG
+                printf("return leaf ins\n");
+            #endif
+            int nvars = next_short(&ip);
+            intptr_t* base = fp - nvars;
+            if (leaf_ret) {
+                fp = leaf_fp;
+                ip = leaf_ret;
+                leaf_ret = NULL;
+            } else {
+                ip = (char*) fp[1];
+                fp = vm->stack + fp[0];
+            }
+            RETURN_SP(base);
+            NEXT();
         }
-        case DROP_INS : {
+        OP(DROP_INS) : {
             #ifdef DEBUG
                 printf("drop ins\n");
             #endif
-            vector_pop(vm->stack);
-            break;
+            DROP();
+            NEXT();
         }
-        case FRAME_INS : {
+        // Calls enter the callee's frame in push_call, so only the entry
+        // method executes its FRAME_INS.
+        OP(FRAME_INS) : {
             #ifdef DEBUG
                 printf("frame ins\n");
             #endif
-            add_frame(vm);
-            break;
+            add_frame(vm, &ip, &sp, &fp, NULL);
+            NEXT();
+        }
+        OP(SET_LOCAL_DROP_GET_LOCAL_INT_INS) : {
+            int dst = next_local(&ip);
+            SKIP_OP();
+            SKIP_OP();
+            int src = next_local(&ip);
+            SKIP_OP();
+            int i = next_int(&ip);
+            #ifdef DEBUG
+                printf("set local drop get local int : %d %d %d\n", dst, src, i);
+            #endif
+            fp[dst] = TOS;
+            TOS = fp[src];
+            PUSH(create_int(i));
+            NEXT();
+        }
+        OP(SET_LOCAL_DROP_GET_LOCAL_INS) : {
+            int dst = next_local(&ip);
+            SKIP_OP();
+            SKIP_OP();
+            int src = next_local(&ip);
+            #ifdef DEBUG
+                printf("set local drop get local : %d %d\n", dst, src);
+            #endif
+            fp[dst] = TOS;
+            TOS = fp[src];
+            NEXT();
+        }
+        OP(DROP_GET_LOCAL_INT_INS) : {
+            SKIP_OP();
+            int idx = next_local(&ip);
+            SKIP_OP();
+            int i = next_int(&ip);
+            #ifdef DEBUG
+                printf("drop get local int : %d %d\n", idx, i);
+            #endif
+            TOS = fp[idx];
+            PUSH(create_int(i));
+            NEXT();
+        }
+        OP(SET_LOCAL_DROP_INS) : {
+            int idx = next_local(&ip);
+            SKIP_OP();
+            #ifdef DEBUG
+                printf("set local drop : %d\n", idx);
+            #endif
+            fp[idx] = TOS;
+            DROP();
+            NEXT();
         }
+        OP(DROP_GET_LOCAL_INS) : {
+            SKIP_OP();
+            int idx = next_local(&ip);
+            #ifdef DEBUG
+                printf("drop get local : %d\n", idx);
+            #endif
+            TOS = fp[idx];
+            NEXT();
+        }
+        OP(GET_LOCAL_INT_INS) : {
+            int idx = next_local(&ip);
+            SKIP_OP();
+            int i = next_int(&ip);
+            #ifdef DEBUG
+                printf("get local int : %d %d\n", idx, i);
+            #endif
+            PUSH(fp[idx]);
+            PUSH(create_int(i));
+            NEXT();
+        }
+        OP(GET_LOCAL_GET_LOCAL_INS) : {
+            int a = next_local(&ip);
+            SKIP_OP();
+            int b = next_local(&ip);
+            #ifdef DEBUG
+                printf("get local get local : %d %d\n", a, b);
+            #endif
+            PUSH(fp[a]);
+            PUSH(fp[b]);
+            NEXT();
+        }
+  #ifndef THREADED
         default: {
+            flush_output(vm);
             printf("Unknown tag: %d\n", tag);
             exit(-1);
         }
     }  
   }
+  #endif
 }
 
 
@@ -612,8 +1791,8 @@ intptr_t create_null_or_int(VM* vm, int a) {
 }
 
 void int_function_call(VM* vm, char* name) {
-    intptr_t y = (intptr_t) vector_pop(vm->stack);
-    intptr_t x = (intptr_t) vector_pop(vm->stack);
+    intptr_t y = pop(vm);
+    intptr_t x = pop(vm);
     intptr_t value;
     if(strcmp(name, "eq") == 0)
         value = create_null_or_int(vm, x == y);
@@ -626,43 +1805,96 @@ void int_function_call(VM* vm, char* name) {
     else if(strcmp(name, "ge") == 0)
         value = create_null_or_int(vm, x >= y);
     else if(strcmp(name, "add") == 0)
-        value = x + y;
+        value = int_add(vm, x, y);
     else if(strcmp(name, "sub") == 0)
-        value = x - y;
+        value = int_sub(vm, x, y);
     else if(strcmp(name, "mul") == 0)
-        value = create_int(get_int(x) * get_int(y));
+        value = int_mul(vm, x, y);
     else if(strcmp(name, "div") == 0)
-        value = create_int(x / y);
+        value = int_div(vm, x, y);
     else if(strcmp(name, "mod") == 0)
-        value = x % y;
+        value = int_mod(vm, x, y);
     else {
+        flush_output(vm);
         printf("No slot named %s for Int.\n", name);
         exit(-1);
     }
-    vector_add(vm->stack, (void*) value);
+    push(vm, value);
+}
+
+// The bulk builtins check their arguments up front, since a bad range
+// would take them far past the end of an array.
+VMArray* array_arg(VM* vm, intptr_t ptr) {
+    if (!is_array(ptr)) {
+        flush_output(vm);
+        printf("Expected an array.\n");
+        exit(-1);
+    }
+    return (VMArray*) get_obj(ptr);
+}
+
+void check_range(VM* vm, VMArray* array, long pos, long len) {
+    if (pos < 0 || len < 0 || pos + len > array->length) {
+        flush_output(vm);
+        printf("Range %ld to %ld out of bounds.\n", pos, pos + len);
+        exit(-1);
+    }
 }
 
 void array_function_call(VM* vm, char* name) {
     intptr_t value;
     if(strcmp(name, "get") == 0) {
-        intptr_t i = (intptr_t) vector_pop(vm->stack);
-        intptr_t array_ptr = (intptr_t) vector_pop(vm->stack);
+        intptr_t i = pop(vm);
+        intptr_t array_ptr = pop(vm);
         VMArray* array = (VMArray*) get_obj(array_ptr);
         value = array->items[get_int(i)];
     } else if(strcmp(name, "set") == 0) {
-        intptr_t value = (intptr_t) vector_pop(vm->stack);
-        intptr_t pos = (intptr_t) vector_pop(vm->stack);
-        intptr_t array_ptr = (intptr_t) vector_pop(vm->stack);
+        intptr_t item = pop(vm);
+        intptr_t pos = pop(vm);
+        intptr_t array_ptr = pop(vm);
         VMArray* array = (VMArray*) get_obj(array_ptr);
-        array->items[get_int(pos)] = value;
+        store_element(array, get_int(pos), item);
         value = vm->null;
     } else if(strcmp(name, "length") == 0) {
-        intptr_t array_ptr = (intptr_t) vector_pop(vm->stack);
+        intptr_t array_ptr = pop(vm);
         VMArray* array = (VMArray*) get_obj(array_ptr);
         value = create_int(array->length);
+    } else if(strcmp(name, "fill") == 0) {
+        intptr_t item = pop(vm);
+        intptr_t array_ptr = pop(vm);
+        VMArray* array = (VMArray*) get_obj(array_ptr);
+        if (get_tag_value(item) == OBJ_PTAG) array->kind = GENERIC_ELEMENTS;
+        fill_words(array->items, item, array->length);
+        value = vm->null;
+    } else if(strcmp(name, "copy-from") == 0) {
+        long len = get_int(pop(vm));
+        long dstpos = get_int(pop(vm));
+        long srcpos = get_int(pop(vm));
+        VMArray* src = array_arg(vm, pop(vm));
+        intptr_t array_ptr = pop(vm);
+        VMArray* array = (VMArray*) get_obj(array_ptr);
+        check_range(vm, src, srcpos, len);
+        check_range(vm, array, dstpos, len);
+        if (src->kind == GENERIC_ELEMENTS) array->kind = GENERIC_ELEMENTS;
+        memmove(array->items + dstpos, src->items + srcpos, sizeof(intptr_t) * len);
+        value = vm->null;
+    } else if(strcmp(name, "index-of") == 0) {
+        intptr_t item = pop(vm);
+        intptr_t array_ptr = pop(vm);
+        VMArray* array = (VMArray*) get_obj(array_ptr);
+        long i = find_word(array->items, item, array->length);
+        value = i < 0 ? vm->null : create_int(i);
+    } else if(strcmp(name, "equals") == 0) {
+        intptr_t other_ptr = pop(vm);
+        intptr_t array_ptr = pop(vm);
+        VMArray* array = (VMArray*) get_obj(array_ptr);
+        VMArray* other = is_array(other_ptr) ? (VMArray*) get_obj(other_ptr) : NULL;
+        int equal = other && other->length == array->length && equal_words(array->items, other->items, array->length);
+        value = equal ? create_int(1) : vm->null;
     } else {
-        printf("No slot named %s for Int.\n", name);
+        flush_output(vm);
+        printf("No slot named %s for Array.\n", name);
         exit(-1);
     }
-    vector_add(vm->stack, (void*) value); 
+    push(vm, value);
 }
@@ -3,15 +3,13 @@
 
 #include <stdint.h>
 #include "quicken.h"
+#include "simd.h"
 
 //#define DEBUG
 
 #define MB (1024 * 1024)
-
-typedef struct {
-    Vector* stack;
-    int fp;
-} StackFrame;
+#define STACK_INIT_SIZE (64 * 1024)
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
 
 typedef struct {
     int size;
@@ -44,27 +42,120 @@ typedef struct {
 
 typedef struct {
     long tag;
+    long shape;
     void* parent;
     intptr_t slots[];
 } VMObj;
 
+// Arrays start out holding only ints and null, neither of which points
+// into the heap, and turn GENERIC for good on the first store of an object.
+// The GC copies every array but only scans the GENERIC ones.
+typedef enum {
+    IMMEDIATE_ELEMENTS,
+    GENERIC_ELEMENTS
+} ElementsKind;
+
 typedef struct {
     long tag;
-    long length;
+    int length;
+    ElementsKind kind;
     intptr_t items[];
 } VMArray;
 
 
+// A shape stands for a class tag together with the shapes of every parent
+// below it, so objects built the same way share one. memo maps selectors to
+// where they resolve on that chain and is filled in on first lookup.
+typedef struct {
+    int sel;
+    int depth;
+    CSlot slot;
+} ShapeSlot;
+
+typedef struct {
+    int tag;
+    int parent;
+    int memo_size;
+    int memo_mask;
+    ShapeSlot* memo;
+} Shape;
+
+// VM-wide lookup cache in front of get_slot, indexed by a hash of (shape,
+// selector).
+#define METHOD_CACHE_SIZE 1024
+
+typedef struct {
+    int shape;
+    int sel;
+    int depth;
+    CSlot slot;
+} MethodCacheEntry;
+
+typedef struct {
+    long hits;
+    long misses;
+    long collisions;
+} MethodCacheStats;
+
+// Build with -DOP_STATS to count executed dispatches and the opcode n-grams
+// they form, up to NGRAM_MAX long. An n-gram's key packs its length in the
+// low 3 bits and its tags, newest first, in 6 bits each above.
+#ifdef OP_STATS
+#define NGRAM_MAX 4
+#define NGRAM_TABLE_SIZE 8192
+
+typedef struct {
+    int key;
+    long count;
+} NGram;
+
+typedef struct {
+    long dispatches;
+    int recent[NGRAM_MAX];
+    int nrecent;
+    NGram table[NGRAM_TABLE_SIZE];
+} OpStats;
+#endif
+
 typedef struct {
     Vector* classes;
     Code* code_buffer;
-    StackFrame* fstack;
+    Vector* stack_map;
+    Vector* once_globals;
+    Vector* slot_sites;
+    Vector* selectors;
+    Vector* formats;
+    MethodCacheEntry* method_cache;
+    MethodCacheStats method_cache_stats;
+#ifdef OP_STATS
+    OpStats* op_stats;
+#endif
+    Vector* shapes;
+    int* shape_index;
+    int shape_index_mask;
     intptr_t null;
-    Vector* stack;
+    // Program output, written to stdout when full, when the program ends
+    // and before the VM prints anything of its own.
+    char* out;
+    int out_len;
+    // One stack holds every frame and its operands. A frame is
+    //   [args][locals][saved fp][return ip][spill][operands...]
+    // with fp pointing at the saved fp, so a callee's arguments are the
+    // caller's top operands. runvm caches the top operand in a register
+    // and keeps only the ones below it here; the first push in a frame
+    // writes the register's stale contents to the spill word, which
+    // nothing reads. With -DNO_TOS_CACHE the word is left unused.
+    intptr_t* stack;
+    intptr_t* stack_limit;
     Heap* heap;
-    char* ip;
+    // Inside runvm ip, sp, fp and heap->sp live in locals and are written
+    // back here before anything outside the loop looks at them. They are
+    // kept apart so GCC does not pack pairs of them into vector registers.
+    intptr_t* sp;
     int genv_size;
+    intptr_t* fp;
     intptr_t* genv;
+    char* ip;
 } VM;
 
 typedef struct {
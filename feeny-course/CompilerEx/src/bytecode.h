@@ -4,6 +4,7 @@
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
+#include<stdint.h>
 #include "utils.h"
 
 typedef enum {
@@ -53,7 +54,7 @@ typedef struct {
 
 typedef struct {
   ValTag tag;
-  int* value;
+  intptr_t* value;
   int len;
 } ArrayValue;
 
@@ -1,16 +1,46 @@
 #include "frame.h"
 #include <stdlib.h>
 
-Frame* make_frame(int size, Frame* current_frame, void** return_address) {
-    void** variables = (void**)malloc(sizeof(void*) * size);
-    Frame* frame = malloc(sizeof(Frame));
+#define FRAME_HEADER (sizeof(Frame) / sizeof(void*))
+
+FrameStack* make_frame_stack() {
+    FrameStack* fstack = malloc(sizeof(FrameStack));
+    fstack->capacity = FRAME_STACK_SIZE;
+    fstack->memory = malloc(sizeof(void*) * fstack->capacity);
+    fstack->size = 0;
+    fstack->fp = -1;
+    return fstack;
+}
+
+// Frames are addressed by offset, so growing the stack may move it but
+// callers must refresh their Frame* from the return value.
+Frame* push_frame(FrameStack* fstack, int size, void** return_address) {
+    long needed = fstack->size + FRAME_HEADER + size;
+    if (needed > fstack->capacity) {
+        while (fstack->capacity < needed) fstack->capacity *= 2;
+        fstack->memory = realloc(fstack->memory, sizeof(void*) * fstack->capacity);
+        if (fstack->memory == NULL) {
+            printf("Frame stack overflow.\n");
+            exit(-1);
+        }
+    }
+    Frame* frame = (Frame*) (fstack->memory + fstack->size);
     frame->return_address = return_address;
-    frame->variables = variables;
-    frame->parent = current_frame;
+    frame->parent = fstack->fp;
+    fstack->fp = fstack->size;
+    fstack->size = needed;
     return frame;
 }
 
-void destroy_frame(Frame* frame) {
-    free(frame->variables);
-    free(frame);
-}
\ No newline at end of file
+Frame* pop_frame(FrameStack* fstack) {
+    Frame* frame = (Frame*) (fstack->memory + fstack->fp);
+    fstack->size = fstack->fp;
+    fstack->fp = frame->parent;
+    if (fstack->fp < 0) return NULL;
+    return (Frame*) (fstack->memory + fstack->fp);
+}
+
+void destroy_frame_stack(FrameStack* fstack) {
+    free(fstack->memory);
+    free(fstack);
+}
@@ -4,14 +4,27 @@
 #include <stddef.h>
 #include "bytecode.h"
 
+#define FRAME_STACK_SIZE (1024 * 64)
+
+// A frame lives inline in the frame stack: two header words followed by
+// its variables. parent is the offset of the caller's frame, -1 for the entry.
 typedef struct {
     void** return_address;
-    void** variables;
-    void* parent;
+    long parent;
+    void* variables[];
 } Frame;
 
-Frame* make_frame(int size, Frame* current_frame, void** return_address);
-void destroy_frame(Frame* frame);
+typedef struct {
+    void** memory;
+    long size;
+    long capacity;
+    long fp;
+} FrameStack;
+
+FrameStack* make_frame_stack();
+Frame* push_frame(FrameStack* fstack, int size, void** return_address);
+Frame* pop_frame(FrameStack* fstack);
+void destroy_frame_stack(FrameStack* fstack);
 
 
-#endif
\ No newline at end of file
+#endif
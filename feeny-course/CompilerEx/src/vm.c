@@ -5,7 +5,7 @@
 
 #include "vm.h"
 
-void add_globals(ht* hm, Vector* const_pool, Vector* globals);
+void add_globals(VM* vm, Vector* const_pool, Vector* globals);
 void interpret(ht*, int entry_point);
 void run(VM* vm);
 void add_labels(ht* hm, Vector* const_pool);
@@ -27,24 +27,58 @@ void op_array(VM* vm);
 void op_print(VM* vm, PrintfIns* i);
 void op_lit(VM* vm, LitIns* i);
 
-MethodValue* search_class_for_method(VM* vm, ClassValue* class, int method_name);
-Value* fe_set(void** args);
-Value* fe_get(void** args);
-Value* fe_len(void** args);
-Value* fe_add(void** args);
-Value* fe_sub(void** args);
-Value* fe_mult(void** args);
-Value* fe_div(void** args);
-Value* fe_mod(void** args);
-Value* fe_lt(void** args);
-Value* fe_le(void** args);
-Value* fe_gt(void** args);
-Value* fe_ge(void** args);
-Value* fe_eq(void** args);
-Value* create_int(int a);
-Value* create_null_or_int(int a);
+MethodValue* search_class_for_method(VM* vm, ClassValue* object, int method_name);
+intptr_t fe_set(intptr_t* args);
+intptr_t fe_get(intptr_t* args);
+intptr_t fe_len(intptr_t* args);
+intptr_t fe_add(intptr_t* args);
+intptr_t fe_sub(intptr_t* args);
+intptr_t fe_mult(intptr_t* args);
+intptr_t fe_div(intptr_t* args);
+intptr_t fe_mod(intptr_t* args);
+intptr_t fe_lt(intptr_t* args);
+intptr_t fe_le(intptr_t* args);
+intptr_t fe_gt(intptr_t* args);
+intptr_t fe_ge(intptr_t* args);
+intptr_t fe_eq(intptr_t* args);
+intptr_t create_null_or_int(int a);
 ht* init_builtins();
-Value* format_print(StringValue* format_string, void** args);
+intptr_t format_print(StringValue* format_string, intptr_t* args);
+
+//===================== TAGGING ================================
+
+typedef enum {
+    INT_PTAG,
+    OBJ_PTAG,
+    NULL_PTAG,
+} PTAG;
+
+static const intptr_t tagMask = 7;
+
+intptr_t create_int(int value) {
+    return (intptr_t) value << 3;
+}
+
+int get_int(intptr_t value) {
+    return (int) (value >> 3);
+}
+
+intptr_t create_null() {
+    return (intptr_t) NULL_PTAG;
+}
+
+intptr_t set_obj_bit(Value* ptr) {
+    return ((intptr_t) ptr) | 1;
+}
+
+Value* get_obj(intptr_t ptr) {
+    return (Value*) (ptr & ~1);
+}
+
+int get_tag_value(intptr_t value) {
+    return value & tagMask;
+}
+
 
 VM* init_vm(Program* p) {
   VM* vm = malloc(sizeof(VM));
@@ -52,13 +86,14 @@ VM* init_vm(Program* p) {
   vm->hm = ht_create();
   vm->labels = ht_create();
   vm->inbuilt = init_builtins();
-  add_globals(vm->hm, p->values, p->slots);
+  add_globals(vm, p->values, p->slots);
   add_labels(vm->labels, p->values);
   MethodValue* entry_func = (MethodValue*) vector_get(p->values, p->entry);
   vm->IP = &entry_func->code->array[0];
-  vm->current_frame =  make_frame(entry_func->nargs + entry_func->nlocals, 
-                                  NULL, 
-                                  vm->IP);
+  vm->frames = make_frame_stack();
+  vm->current_frame = push_frame(vm->frames,
+                                 entry_func->nargs + entry_func->nlocals,
+                                 vm->IP);
   vm->const_pool = p->values;
   print_prog(p);
   return vm;
@@ -68,7 +103,8 @@ void free_vm(VM* vm) {
   ht_destroy(vm->hm);
   ht_destroy(vm->inbuilt);
   ht_destroy(vm->labels);
-  destroy_frame(vm->current_frame);
+  free(vm->genv);
+  destroy_frame_stack(vm->frames);
   vector_free(vm->stack);
   vector_free(vm->const_pool);
   free(vm->IP);
@@ -102,21 +138,26 @@ void add_labels(ht* hm, Vector* const_pool) {
   }
 }
 
-void add_globals(ht* hm, Vector* const_pool, Vector* globals) {
+// Methods map to their MethodValue, global variables to a cell in genv.
+void add_globals(VM* vm, Vector* const_pool, Vector* globals) {
+  vm->genv = malloc(sizeof(intptr_t) * globals->size);
   for (int i = 0; i < globals->size; i++) {
     void* value_idx = vector_get(const_pool, (int)vector_get(globals, i));
     int name_idx = ((Value*) value_idx)->tag == SLOT_VAL ? ((SlotValue*) value_idx)->name : ((MethodValue*) value_idx)->name;
     char* name = ((StringValue*)vector_get(const_pool, name_idx))->value;
-    ht_set(hm, name, value_idx);
+    if (((Value*) value_idx)->tag == SLOT_VAL) {
+      vm->genv[i] = create_null();
+      ht_set(vm->hm, name, &vm->genv[i]);
+    } else {
+      ht_set(vm->hm, name, value_idx);
+    }
   }
 }
 
 void op_return(VM* vm) {
-  if (vm->current_frame->parent != NULL) {
-    Frame* old_frame = vm->current_frame;
+  if (vm->current_frame->parent >= 0) {
     vm->IP = vm->current_frame->return_address;
-    vm->current_frame = vm->current_frame->parent;
-    destroy_frame(old_frame);
+    vm->current_frame = pop_frame(vm->frames);
   } else {
     exit(1);
   }
@@ -133,8 +174,8 @@ void op_goto(VM* vm, GotoIns* i) {
 }
 
 void op_branch(VM* vm, BranchIns* i) {
-  Value* value = (Value*) vector_pop(vm->stack);
-  if (value->tag == NULL_VAL) {
+  intptr_t value = (intptr_t) vector_pop(vm->stack);
+  if (get_tag_value(value) == NULL_PTAG) {
     vm->IP++;
     return;
   }
@@ -144,13 +185,15 @@ void op_branch(VM* vm, BranchIns* i) {
 
 void op_get_global(VM* vm, GetGlobalIns* i) {
   StringValue* string = (StringValue*) vector_get(vm->const_pool, i->name);
-  vector_add(vm->stack, ht_get(vm->hm, string->value));
+  intptr_t* cell = ht_get(vm->hm, string->value);
+  vector_add(vm->stack, (void*) *cell);
   vm->IP++;
 }
 
 void op_set_global(VM* vm, SetGlobalIns* i) {
   StringValue* string = (StringValue*) vector_get(vm->const_pool, i->name);
-  ht_set(vm->hm, string->value, vector_peek(vm->stack));
+  intptr_t* cell = ht_get(vm->hm, string->value);
+  *cell = (intptr_t) vector_peek(vm->stack);
   vm->IP++;
 }
 
@@ -164,41 +207,59 @@ void op_set_local(VM* vm, SetLocalIns* i) {
   vm->IP++;
 }
 
+// Arguments are read in place from the top of the operand stack.
+intptr_t* stack_args(VM* vm, int arity) {
+  return (intptr_t*) &vm->stack->array[vm->stack->size - arity];
+}
+
+void drop_args(VM* vm, int arity) {
+  vector_set_length(vm->stack, vm->stack->size - arity, NULL);
+}
+
+void enter_method(VM* vm, MethodValue* method, int arity) {
+  vm->current_frame = push_frame(vm->frames, method->nargs + method->nlocals, vm->IP+1);
+  memcpy(vm->current_frame->variables, stack_args(vm, arity), sizeof(void*) * arity);
+  drop_args(vm, arity);
+  vm->IP = &method->code->array[0];
+}
+
 void op_call(VM* vm, CallIns* i) {
   MethodValue* method = (MethodValue*) ht_get(vm->hm, ((StringValue*) vector_get(vm->const_pool, i->name))->value);
-  vm->current_frame = make_frame(method->nargs + method->nlocals, vm->current_frame, vm->IP+1);
-  for (int j = 0; j < i->arity; j++) {
-    vm->current_frame->variables[i->arity - j - 1] = vector_pop(vm->stack);
-  }
-  vm->IP = &method->code->array[0];
+  enter_method(vm, method, i->arity);
 } 
 
+void call_builtin(VM* vm, char* method_name, intptr_t* args, int arity) {
+  intptr_t (*func)(intptr_t*) = ht_get(vm->inbuilt, method_name);
+  intptr_t return_value = (*func)(args);
+  drop_args(vm, arity);
+  vector_add(vm->stack, (void*) return_value);
+  vm->IP++;
+}
+
 void op_call_slot(VM* vm, CallSlotIns* i) {
   char* method_name = ((StringValue*) vector_get(vm->const_pool, i->name))->value;
-  void** args = malloc(sizeof(void*) * i->arity);
-  for (int j = 0; j < i->arity; j++) {
-      args[i->arity - j - 1] = vector_pop(vm->stack);
-  }
-  switch (((Value*)args[0])->tag) {
-    case (ARRAY_VAL):
-    case (INT_VAL): {
-      Value* (*func)(void**) = ht_get(vm->inbuilt, method_name);
-      Value* return_value = (*func)(args); 
-      vector_add(vm->stack, (void*) return_value);
-      vm->IP++;
-      free(args);
+  intptr_t* args = stack_args(vm, i->arity);
+  switch (get_tag_value(args[0])) {
+    case (INT_PTAG): {
+      call_builtin(vm, method_name, args, i->arity);
       break;
     }
-    case (CLASS_VAL): {
-      ClassValue* object = (ClassValue*) args[0];
-      MethodValue* method = search_class_for_method(vm, object, i->name);
-      Frame* newFrame = make_frame(method->nargs + method->nlocals, vm->current_frame, vm->IP+1);
-      for (int j = 0; j < i->arity; j++) {
-        newFrame->variables[j] = args[j];
+    case (OBJ_PTAG): {
+      Value* value = get_obj(args[0]);
+      switch (value->tag) {
+        case (ARRAY_VAL): {
+          call_builtin(vm, method_name, args, i->arity);
+          break;
+        }
+        case (CLASS_VAL): {
+          MethodValue* method = search_class_for_method(vm, (ClassValue*) value, i->name);
+          enter_method(vm, method, i->arity);
+          break;
+        }
+        default:
+          printf("Unknown value");
+          exit(-1);
       }
-      vm->current_frame = newFrame;
-      vm->IP = &method->code->array[0];
-      free(args);
       break;
     }
     default:
@@ -209,7 +270,7 @@ void op_call_slot(VM* vm, CallSlotIns* i) {
 
 void op_set_slot(VM* vm, SetSlotIns* i) {
   void* valToStore = vector_pop(vm->stack);
-  ClassValue* object = (ClassValue*) vector_pop(vm->stack);
+  ClassValue* object = (ClassValue*) get_obj((intptr_t) vector_pop(vm->stack));
   ClassValue* class = (ClassValue*) vector_get(object->slots, object->slots->size - 2);
   int varIdx;
   for (int j = 0; j < class->slots->size; j++) {
@@ -226,7 +287,7 @@ void op_set_slot(VM* vm, SetSlotIns* i) {
 }
 
 void op_slot(VM* vm, SlotIns* i) {
-  ClassValue* object = (ClassValue*) vector_pop(vm->stack);
+  ClassValue* object = (ClassValue*) get_obj((intptr_t) vector_pop(vm->stack));
   ClassValue* class = (ClassValue*) vector_get(object->slots, object->slots->size - 2);
   StringValue* name = (StringValue*) vector_get(vm->const_pool, i->name);
   int varIdx;
@@ -259,40 +320,41 @@ void op_object(VM* vm, ObjectIns* i) {
   }
   vector_add(newObject->slots, class);
   vector_add(newObject->slots, vector_pop(vm->stack));
-  vector_add(vm->stack, newObject);
+  vector_add(vm->stack, (void*) set_obj_bit((Value*) newObject));
   free(emptyVal);
   vm->IP++;
 }
 
 void op_array(VM* vm) {
-  IntValue* initial = (IntValue*) vector_pop(vm->stack);
-  IntValue* len = (IntValue*) vector_pop(vm->stack);
-  int* array = (int*) malloc(sizeof(int) * len->value);
-  for (int i = 0; i < len->value; i++) {
-    array[i] = initial->value;
+  intptr_t initial = (intptr_t) vector_pop(vm->stack);
+  int len = get_int((intptr_t) vector_pop(vm->stack));
+  intptr_t* array = malloc(sizeof(intptr_t) * len);
+  for (int i = 0; i < len; i++) {
+    array[i] = initial;
   }
   ArrayValue* value = malloc(sizeof(ArrayValue));
   value->tag = ARRAY_VAL;
   value->value = array;
-  value->len = len->value;
-  vector_add(vm->stack, (void *) value);
-  ArrayValue* arrayVal = (ArrayValue* ) vector_peek(vm->stack);
+  value->len = len;
+  vector_add(vm->stack, (void *) set_obj_bit((Value*) value));
   vm->IP++;
 }
 
 void op_print(VM* vm, PrintfIns* i) {
   StringValue* string_format = (StringValue*) vector_get(vm->const_pool, i->format);
-  void** args = malloc(sizeof(void*) * i->arity);
-  for (int j = 0; j < i->arity; j++) {
-    args[i->arity - j - 1] = vector_pop(vm->stack);
-  }
-  Value* null = format_print(string_format, args);
-  vector_add(vm->stack, null);
+  intptr_t null = format_print(string_format, stack_args(vm, i->arity));
+  drop_args(vm, i->arity);
+  vector_add(vm->stack, (void*) null);
   vm->IP++;
 }
 
 void op_lit(VM* vm, LitIns* i) {
-  vector_add(vm->stack, vector_get(vm->const_pool, i->idx));
+  Value* value = (Value*) vector_get(vm->const_pool, i->idx);
+  if (value->tag == INT_VAL) {
+    vector_add(vm->stack, (void*) create_int(((IntValue*) value)->value));
+  } else {
+    vector_add(vm->stack, (void*) create_null());
+  }
   vm->IP++;
 }
 
@@ -446,18 +508,19 @@ void run(VM* vm) {
 
 //===================== UTILS ================================
 
-MethodValue* search_class_for_method(VM* vm, ClassValue* class, int method_name) {
-    for (int j = 0; j < class->slots->size; j++) {
-      Value* value = (Value*) vector_get(class->slots, class->slots->size - j - 1); 
+MethodValue* search_class_for_method(VM* vm, ClassValue* object, int method_name) {
+    ClassValue* class = (ClassValue*) vector_get(object->slots, object->slots->size - 2);
+    for (int j = class->slots->size - 1; j >= 0; j--) {
+      Value* value = (Value*) vector_get(vm->const_pool, (int) vector_get(class->slots, j));
       if (value->tag == METHOD_VAL) {
         MethodValue* methodVal = (MethodValue* ) value;
         if (methodVal->name == method_name) {
           return methodVal;
-          //vm->IP = &methodVal->code->array[0];
         }
       }
     }
-    search_class_for_method(vm, (ClassValue*) vector_peek(class->slots), method_name);
+    ClassValue* parent = (ClassValue*) get_obj((intptr_t) vector_peek(object->slots));
+    return search_class_for_method(vm, parent, method_name);
 }
 
 //===================== BUILTINS ================================
@@ -481,93 +544,80 @@ ht* init_builtins() {
   return inbuilt_hash;
 }
 
-Value* fe_set(void** args) {
-  IntValue* pos = ((IntValue*) args[1]);
-  IntValue* value = ((IntValue*) args[2]);
-  ((ArrayValue*) args[0])->value[((IntValue*) args[1])->value] = value->value;
-  return create_null_or_int(0);
+ArrayValue* get_array(intptr_t ptr) {
+  return (ArrayValue*) get_obj(ptr);
 }
 
-Value* fe_get(void** args) {
-  int value = ((ArrayValue*) args[0])->value[((IntValue*) args[1])->value];
-  return create_int(value);
+intptr_t fe_set(intptr_t* args) {
+  get_array(args[0])->value[get_int(args[1])] = args[2];
+  return create_null();
 }
 
-Value* fe_len(void** args) {
-  return create_int(((ArrayValue* ) args[0])->len);
+intptr_t fe_get(intptr_t* args) {
+  return get_array(args[0])->value[get_int(args[1])];
 }
 
-Value* fe_add(void** args) {
-  return create_int(((IntValue*) args[0])->value + ((IntValue*) args[1])->value);
+intptr_t fe_len(intptr_t* args) {
+  return create_int(get_array(args[0])->len);
 }
 
-Value* fe_sub(void** args) {
-  return create_int(((IntValue*) args[0])->value - ((IntValue*) args[1])->value);
+// Tagged ints have a zero tag, so add/sub/mod work on them directly.
+intptr_t fe_add(intptr_t* args) {
+  return args[0] + args[1];
 }
 
-Value* fe_mult(void** args) {
-  return create_int(((IntValue*) args[0])->value * ((IntValue*) args[1])->value);
+intptr_t fe_sub(intptr_t* args) {
+  return args[0] - args[1];
 }
 
-Value* fe_div(void** args) {
-  return create_int(((IntValue*) args[0])->value / ((IntValue*) args[1])->value);
+intptr_t fe_mult(intptr_t* args) {
+  return create_int(get_int(args[0]) * get_int(args[1]));
 }
 
-Value* fe_mod(void** args) {
-  return create_int(((IntValue*) args[0])->value % ((IntValue*) args[1])->value);
+intptr_t fe_div(intptr_t* args) {
+  return create_int(get_int(args[0]) / get_int(args[1]));
 }
 
-Value* fe_lt(void** args) {
-  return create_null_or_int(((IntValue*) args[0])->value < ((IntValue*) args[1])->value);
+intptr_t fe_mod(intptr_t* args) {
+  return args[0] % args[1];
 }
 
-Value* fe_le(void** args) {
-  return create_null_or_int(((IntValue*) args[0])->value <= ((IntValue*) args[1])->value);
+intptr_t fe_lt(intptr_t* args) {
+  return create_null_or_int(args[0] < args[1]);
 }
 
-Value* fe_gt(void** args) {
-  return create_null_or_int(((IntValue*) args[0])->value > ((IntValue*) args[1])->value);
+intptr_t fe_le(intptr_t* args) {
+  return create_null_or_int(args[0] <= args[1]);
 }
 
-Value* fe_ge(void** args) {
-  return create_null_or_int(((IntValue*) args[0])->value >= ((IntValue*) args[1])->value);
+intptr_t fe_gt(intptr_t* args) {
+  return create_null_or_int(args[0] > args[1]);
 }
 
-Value* fe_eq(void** args) {
-  return create_null_or_int(((IntValue*) args[0])->value == ((IntValue*) args[1])->value);
+intptr_t fe_ge(intptr_t* args) {
+  return create_null_or_int(args[0] >= args[1]);
 }
 
-Value* create_null_or_int(int a) {
-  if (a) {
-    return (Value*) create_int(a);
-  }
-  else {
-    Value* value = malloc(sizeof(Value));
-    value->tag = NULL_VAL;
-    return value;
-  }
+intptr_t fe_eq(intptr_t* args) {
+  return create_null_or_int(args[0] == args[1]);
 }
 
-Value* create_int(int a) {
-  IntValue* value = malloc(sizeof(IntValue));
-  value->value = a;
-  value->tag = INT_VAL;
-  return (Value*) value;
+intptr_t create_null_or_int(int a) {
+  if (a) return create_int(a);
+  else return create_null();
 }
 
-Value* format_print(StringValue* format_string, void **args) {
+intptr_t format_print(StringValue* format_string, intptr_t* args) {
     char *string = format_string->value;
     int i = 0;
     while (*string != '\0') {
         if (*string == '~') {
-            printf("%d", ((IntValue*) args[i])->value);
+            printf("%d", get_int(args[i]));
             string++;
             i++;
         }
         printf("%c", *string);
         string++;
     }
-    Value* null = (Value*) malloc(sizeof(NULL_VAL));
-    null->tag = NULL_VAL;
-    return null;
+    return create_null();
 }
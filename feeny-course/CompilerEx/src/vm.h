@@ -1,6 +1,7 @@
 #ifndef VM_H
 #define VM_H
 
+#include <stdint.h>
 #include "bytecode.h"
 #include "ht.h"
 #include "utils.h"
@@ -13,8 +14,10 @@ typedef struct {
     ht* hm;
     ht* labels;
     ht* inbuilt;
+    FrameStack* frames;
     Frame* current_frame;
     Vector* const_pool;
+    intptr_t* genv;
     void** IP;
 } VM;
 
@@ -1,33 +1,50 @@
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
 #include "codebuffer.h"
 
 #define MB (1024 * 1024)
 
+// The whole range is reserved up front and never moves, so absolute
+// pointers into it (CClass slot code, ip) stay valid as code is added.
+// Pages are committed in CODE_COMMIT_CHUNK steps as quickening reaches them.
+#define CODE_RESERVE ((size_t) 1024 * MB)
+#define CODE_COMMIT_CHUNK (64 * 1024)
+
 Code* init_code_buffer() {
     Code* code_buffer = malloc(sizeof(Code));
-    code_buffer->code = malloc(MB * 24);
-    code_buffer->capacity = MB * 24;
+    code_buffer->code = mmap(NULL, CODE_RESERVE, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (code_buffer->code == MAP_FAILED) {
+        printf("Could not reserve code buffer.\n");
+        exit(-1);
+    }
+    code_buffer->reserved = CODE_RESERVE;
+    code_buffer->committed = 0;
     code_buffer->sp = code_buffer->code;
     return code_buffer;
 }
 
 void free_code_buffer(Code* code_buffer) {
-  free(code_buffer->code);
+  munmap(code_buffer->code, code_buffer->reserved);
   free(code_buffer);
 }
 
 void check_size(Code* code_buffer) {
-  int size = code_buffer->sp - code_buffer->code;
-  if (size + 2 * sizeof(long) > code_buffer->capacity) {
-    int new_cap = code_buffer->capacity * 2;
-    char* buf = malloc(new_cap);
-    memcpy(buf, code_buffer->code, size);
-    free(code_buffer->code);
-    code_buffer->code = buf;
-    code_buffer->capacity = new_cap;
-    code_buffer->sp = code_buffer->code + size;
+  size_t size = code_buffer->sp - code_buffer->code;
+  if (size + 2 * sizeof(long) > code_buffer->committed) {
+    size_t new_commit = code_buffer->committed + CODE_COMMIT_CHUNK;
+    if (new_commit > code_buffer->reserved) {
+      printf("Code buffer exhausted.\n");
+      exit(-1);
+    }
+    if (mprotect(code_buffer->code + code_buffer->committed, CODE_COMMIT_CHUNK,
+                 PROT_READ | PROT_WRITE) != 0) {
+      printf("Could not commit code buffer page.\n");
+      exit(-1);
+    }
+    code_buffer->committed = new_commit;
   }
 }
 
@@ -35,16 +52,6 @@ int get_code_idx(Code* code_buffer) {
     return code_buffer->sp - code_buffer->code;
 }
 
-void align_short (Code* code_buffer) {
-  code_buffer->sp = (char*)(((long)code_buffer->sp + 1)&(-2));
-}
-void align_int (Code* code_buffer) {
-  code_buffer->sp = (char*)(((long)code_buffer->sp + 3)&(-4));
-}
-void align_ptr (Code* code_buffer) {
-  code_buffer->sp = (char*)(((long)code_buffer->sp + 7)&(-8));
-}
-
 void write_char (Code* code_buffer, char c) {
   check_size(code_buffer);  
   code_buffer->sp[0] = c;
@@ -53,29 +60,26 @@ void write_char (Code* code_buffer, char c) {
 
 void write_short (Code* code_buffer, short s) {
   check_size(code_buffer);
-  align_short(code_buffer);
-  ((short*)code_buffer->sp)[0] = s;
+  memcpy(code_buffer->sp, &s, sizeof(short));
   code_buffer->sp += sizeof(short);
 }
 
 void write_int (Code* code_buffer, int i) {
   check_size(code_buffer);
-  align_int(code_buffer);
-  ((int*)code_buffer->sp)[0] = i;
+  memcpy(code_buffer->sp, &i, sizeof(int));
   code_buffer->sp += sizeof(int);
 }
 
 void write_ptr (Code* code_buffer, void* ptr) {
   check_size(code_buffer);
-  align_ptr(code_buffer);
-  ((void**)code_buffer->sp)[0] = ptr;
+  memcpy(code_buffer->sp, &ptr, sizeof(void*));
   code_buffer->sp += sizeof(void*);
 }
 
+void patch_short (Code* code_buffer, int pos, short s) {
+  memcpy(code_buffer->code + pos, &s, sizeof(short));
+}
 
-
-
-
-
-
-
+void patch_int (Code* code_buffer, int pos, int i) {
+  memcpy(code_buffer->code + pos, &i, sizeof(int));
+}
@@ -3,22 +3,27 @@
 
 #include <stdlib.h>
 
+// Quickened code is packed without padding: 1-byte opcodes followed by
+// 16/32-bit operands, pointers, and 32-bit branch offsets relative to the
+// end of the offset operand. All accesses are unaligned-safe. This is about
+// half the size of the old int-opcode, pointer-aligned layout; dispatch
+// speed was the same within run-to-run spread.
 typedef struct {
     char* code;
-    int capacity;
+    size_t reserved;
+    size_t committed;
     char* sp;
 } Code;
 
 Code* init_code_buffer();
 void check_size(Code* code_buffer);
 int get_code_idx(Code* code_buffer);
-void align_short (Code* code_buffer);
-void align_int (Code* code_buffer);
-void align_ptr (Code* code_buffer);
 void write_char (Code* code_buffer, char c);
 void write_short (Code* code_buffer, short s);
 void write_int (Code* code_buffer, int i);
 void write_ptr (Code* code_buffer, void* ptr);
+void patch_short (Code* code_buffer, int pos, short s);
+void patch_int (Code* code_buffer, int pos, int i);
 void free_code_buffer(Code* code_buffer);
 
-#endif
\ No newline at end of file
+#endif
@@ -12,12 +12,17 @@ void init_classes(Quicken* q) {
     }
 }
 
-Quicken* init_quicken(Program* program){
+Quicken* init_quicken(Program* program, void** handlers){
     Quicken* q = malloc(sizeof(Quicken));
     q->patch_buffer = make_vector();
     q->globals = make_vector();
     q->program = program;
-    q->hm = ht_create();
+    q->handlers = handlers;
+    q->entries = calloc(program->values->size, sizeof(Entry));
+    q->global_idx = malloc(sizeof(int) * program->values->size);
+    for (int i = 0; i < program->values->size; i++) {
+        q->global_idx[i] = -1;
+    }
     q->code_buffer = init_code_buffer();
     init_classes(q);
     return q;
@@ -36,7 +41,8 @@ VMInfo* create_vm_info(Quicken* q, char* ip) {
 void free_quicken(Quicken* q) {
     vector_free(q->patch_buffer);
     vector_free(q->globals);
-    ht_destroy(q->hm);
+    free(q->entries);
+    free(q->global_idx);
     vector_free(q->program->slots);
     free(q->program);
     free(q);
@@ -45,56 +51,49 @@ void free_quicken(Quicken* q) {
 //---------------------------------------------------------------------------
 //--------------------------------Entries------------------------------------
 //---------------------------------------------------------------------------
-void add_entry(Quicken* q, char* key, int tag) {
-    Entry* entry = malloc(sizeof(Entry));
+// Entries are indexed directly by constant pool id: labels and methods by
+// their own id, classes by the class value, and global methods by name.
+void add_entry(Quicken* q, int const_pool_idx, int tag) {
+    Entry* entry = &q->entries[const_pool_idx];
     entry->code_idx = get_code_idx(q->code_buffer);
     entry->type = tag;
-    ht_set(q->hm, key, entry);
 }
 
-
 void add_class_entry(Quicken* q, int const_pool_idx, int class_idx) {
-    char int_char[11];
-    sprintf(int_char,"%d", const_pool_idx);
-    Entry* entry = malloc(sizeof(Entry));
+    Entry* entry = &q->entries[const_pool_idx];
     entry->type = CLASS_ENTRY;
     entry->class_idx = class_idx;
-    ht_set(q->hm, int_char, entry);
-}
-
-void add_int_entry(Quicken* q, int const_pool_idx, int tag) {
-    char int_char[11];
-    sprintf(int_char,"%d", const_pool_idx);
-    add_entry(q, int_char, tag);
 }
 
-Entry* get_entry(Quicken* q, char* key) {
-    return (Entry*) ht_get(q->hm, key);
-}
-
-Entry* get_entry_by_int(Quicken* q, int const_pool_idx) {
-    char int_char[11];
-    sprintf(int_char,"%d", const_pool_idx);
-    return get_entry(q, int_char);
+Entry* get_entry(Quicken* q, int const_pool_idx) {
+    Entry* entry = &q->entries[const_pool_idx];
+    if (entry->type == NO_ENTRY) {
+        printf("No entry for constant #%d.\n", const_pool_idx);
+        exit(-1);
+    }
+    return entry;
 }
 
-Entry* link_entries_with_int(Quicken* q, Entry* entry, int name) {
-    char int_char[11];
-    sprintf(int_char,"%d", name);
-    ht_set(q->hm, int_char, entry);
+void link_entries(Quicken* q, Entry* entry, int name) {
+    q->entries[name] = *entry;
 }
 
 //---------------------------------------------------------------------------
 //--------------------------------globals------------------------------------
 //---------------------------------------------------------------------------
 
+void add_global(Quicken* q, int name) {
+    q->global_idx[name] = q->globals->size;
+    vector_add(q->globals, (void*) name);
+}
+
 int get_global_idx(Quicken* q, int name) {
-    for (int i = 0; i < q->globals->size; i++) {
-        int gname = (int) vector_get(q->globals, i);
-        if (name == gname) return i;
+    int idx = q->global_idx[name];
+    if (idx < 0) {
+        printf("No global with name %d.\n", name);
+        exit(-1);
     }
-    printf("No global with name %d.\n", name);
-    exit(-1);
+    return idx;
 }
 
 //---------------------------------------------------------------------------
@@ -113,16 +112,22 @@ void make_patch(Quicken* q, int name, int tag) {
     vector_add(q->patch_buffer, patch);
 }
 
-void write_patch_pointer(Quicken* q, int name, int tag) {
-    align_ptr(q->code_buffer);
+void write_patch_offset(Quicken* q, int name, int tag) {
     make_patch(q, name, tag);
-    write_ptr(q->code_buffer, 0);
+    write_int(q->code_buffer, 0);
 }
 
-void write_patch_int(Quicken* q, int name, int tag) {
-    align_int(q->code_buffer);
+void write_patch_short(Quicken* q, int name, int tag) {
     make_patch(q, name, tag);
-    write_int(q->code_buffer, 0);
+    write_short(q->code_buffer, 0);
+}
+
+void write_op(Quicken* q, OpTag tag) {
+    #ifdef THREADED
+        write_ptr(q->code_buffer, q->handlers[tag]);
+    #else
+        write_char(q->code_buffer, tag);
+    #endif
 }
 
 //---------------------------------------------------------------------------
@@ -154,7 +159,7 @@ int make_class(Quicken* q, ClassValue* class) {
                 MethodValue* mval = (MethodValue*)value;
                 cclass->slots[i].tag = CODE_SLOT;
                 cclass->slots[i].name = idx_to_str(q, mval->name);
-                Entry* entry = get_entry_by_int(q, const_pool_idx);
+                Entry* entry = get_entry(q, const_pool_idx);
                 cclass->slots[i].code = q->code_buffer->code + entry->code_idx;
                 break;
             }
@@ -174,7 +179,7 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("label #%d", i->name);
             #endif
-            add_int_entry(q, i->name, LABEL_ENTRY);
+            add_entry(q, i->name, LABEL_ENTRY);
             break;
         }
         case LIT_OP: {
@@ -184,10 +189,10 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #endif
             Value* value = vector_get(q->program->values, i->idx);
             if (value->tag == INT_VAL) {
-                write_int(q->code_buffer, INT_INS);
+                write_op(q, INT_INS);
                 write_int(q->code_buffer, ((IntValue*)value)->value);
             } else if (value->tag == NULL_VAL) {
-                write_int(q->code_buffer, NULL_INS);
+                write_op(q, NULL_INS);
             }
             break;
         }
@@ -196,8 +201,8 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   printf #%d %d", i->format, i->arity);
             #endif
-            write_int(q->code_buffer, PRINTF_INS);
-            write_int(q->code_buffer, i->arity);
+            write_op(q, PRINTF_INS);
+            write_short(q->code_buffer, i->arity);
             StringValue* str = vector_get(q->program->values, i->format);
             write_ptr(q->code_buffer, str->value);
             break;
@@ -206,7 +211,7 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   array");
             #endif
-            write_int(q->code_buffer, ARRAY_INS);
+            write_op(q, ARRAY_INS);
             break;
         }
         case OBJECT_OP: {
@@ -214,9 +219,9 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   object #%d", i->class);
             #endif
-            write_int(q->code_buffer, OBJECT_INS);
-            write_patch_int(q, i->class, CLASS_ARITY_PATCH);
-            write_patch_int(q, i->class, CLASS_TAG_PATCH);
+            write_op(q, OBJECT_INS);
+            write_patch_short(q, i->class, CLASS_ARITY_PATCH);
+            write_patch_short(q, i->class, CLASS_TAG_PATCH);
             break;
         }
         case SLOT_OP: {
@@ -224,7 +229,7 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   slot #%d", i->name);
             #endif
-            write_int(q->code_buffer, SLOT_INS);
+            write_op(q, SLOT_INS);
             write_ptr(q->code_buffer, idx_to_str(q, i->name));
             break;
         }
@@ -233,7 +238,7 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   set-slot #%d", i->name);
             #endif
-            write_int(q->code_buffer, SET_SLOT_INS);
+            write_op(q, SET_SLOT_INS);
             write_ptr(q->code_buffer, idx_to_str(q, i->name));
             break;
         }
@@ -242,8 +247,8 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   call-slot #%d %d", i->name, i->arity);
             #endif
-            write_int(q->code_buffer, CALL_SLOT_INS);
-            write_int(q->code_buffer, i->arity);
+            write_op(q, CALL_SLOT_INS);
+            write_short(q->code_buffer, i->arity);
             StringValue* str = vector_get(q->program->values, i->name);
             write_ptr(q->code_buffer, str->value);
             break;
@@ -253,9 +258,9 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   call #%d %d", i->name, i->arity);
             #endif
-            write_int(q->code_buffer, CALL_INS);
-            write_int(q->code_buffer, i->arity);
-            write_patch_pointer(q, i->name, FUNCTION_PATCH);
+            write_op(q, CALL_INS);
+            write_short(q->code_buffer, i->arity);
+            write_patch_offset(q, i->name, FUNCTION_PATCH);
         break;
         }
         case SET_LOCAL_OP: {
@@ -263,8 +268,8 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   set local %d", i->idx);
             #endif
-            write_int(q->code_buffer, SET_LOCAL_INS);
-            write_int(q->code_buffer, i->idx);
+            write_op(q, SET_LOCAL_INS);
+            write_short(q->code_buffer, i->idx);
             break;
         }
         case GET_LOCAL_OP: {
@@ -272,8 +277,8 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   get local %d", i->idx);
             #endif
-            write_int(q->code_buffer, GET_LOCAL_INS);
-            write_int(q->code_buffer, i->idx);
+            write_op(q, GET_LOCAL_INS);
+            write_short(q->code_buffer, i->idx);
             break;
         }
         case SET_GLOBAL_OP: {
@@ -281,8 +286,8 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   set global #%d", i->name);
             #endif
-            write_int(q->code_buffer, SET_GLOBAL_INS);
-            write_patch_int(q, i->name, INT_PATCH);
+            write_op(q, SET_GLOBAL_INS);
+            write_patch_short(q, i->name, INT_PATCH);
             break;
         }
         case GET_GLOBAL_OP: {
@@ -290,8 +295,8 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   get global #%d", i->name);
             #endif
-            write_int(q->code_buffer, GET_GLOBAL_INS);
-            write_patch_int(q, i->name, INT_PATCH);
+            write_op(q, GET_GLOBAL_INS);
+            write_patch_short(q, i->name, INT_PATCH);
             break;
         }
         case BRANCH_OP: {
@@ -299,8 +304,8 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   branch #%d", i->name);
             #endif
-            write_int(q->code_buffer, BRANCH_INS);
-            write_patch_pointer(q, i->name, LABEL_PATCH);
+            write_op(q, BRANCH_INS);
+            write_patch_offset(q, i->name, LABEL_PATCH);
             break;
         }
         case GOTO_OP: {
@@ -308,22 +313,22 @@ void parse_ops(Quicken* q, ByteIns* ins) {
             #ifdef DEBUG
                 printf("   goto #%d", i->name);
             #endif
-            write_int(q->code_buffer, GOTO_INS);
-            write_patch_pointer(q, i->name, LABEL_PATCH);
+            write_op(q, GOTO_INS);
+            write_patch_offset(q, i->name, LABEL_PATCH);
             break;
         }
         case RETURN_OP: {
             #ifdef DEBUG
                 printf("   return");
             #endif
-                write_int(q->code_buffer, RETURN_INS);
+                write_op(q, RETURN_INS);
             break;
         }
         case DROP_OP: {
             #ifdef DEBUG
                 printf("   drop");
             #endif
-            write_int(q->code_buffer, DROP_INS);
+            write_op(q, DROP_INS);
             break;
         }
         default: {
@@ -337,19 +342,18 @@ void parse_ops(Quicken* q, ByteIns* ins) {
 //--------------------------------process_propgramme-------------------------
 //---------------------------------------------------------------------------
 
-VMInfo* quicken_vm(Program* p) {
-    Quicken* q = init_quicken(p);
+VMInfo* quicken_vm(Program* p, void** handlers) {
+    Quicken* q = init_quicken(p, handlers);
     char* ip = process_programe(q);
     VMInfo* vm_info = create_vm_info(q, ip);
     free_quicken(q);
     return vm_info;
 }
 
-void write_frame (MethodValue* method, Code* code_buffer) {
-  check_size(code_buffer);
-  write_int(code_buffer, FRAME_INS);
-  write_int(code_buffer, method->nargs);
-  write_int(code_buffer, method->nlocals);
+void write_frame (Quicken* q, MethodValue* method) {
+  write_op(q, FRAME_INS);
+  write_short(q->code_buffer, method->nargs);
+  write_short(q->code_buffer, method->nlocals);
 }
 
 void* process_methods(Quicken* q) {
@@ -357,8 +361,8 @@ void* process_methods(Quicken* q) {
         Value* value = vector_get(q->program->values, i);
         if (value->tag == METHOD_VAL) {
             MethodValue* method = (MethodValue*) value;
-            add_int_entry(q, i, METHOD_ENTRY);
-            write_frame(method, q->code_buffer);
+            add_entry(q, i, METHOD_ENTRY);
+            write_frame(q, method);
             for (int j = 0; j < method->code->size; j++) {
                 parse_ops(q, (ByteIns*) vector_get(method->code, j));
             }
@@ -384,13 +388,13 @@ void* process_globals(Quicken* q) {
         switch(value->tag) {
             case (METHOD_VAL): {
                 MethodValue* method = (MethodValue*) value;
-                Entry* entry = get_entry_by_int(q, idx);
-                link_entries_with_int(q, entry, method->name);
+                Entry* entry = get_entry(q, idx);
+                link_entries(q, entry, method->name);
                 break;
             }
             case (SLOT_VAL): {
                 SlotValue* svalue = (SlotValue*) value;
-                vector_add(q->globals, (void*) svalue->name);
+                add_global(q, svalue->name);
                 break;
             }
             default: {
@@ -407,21 +411,22 @@ void* process_patches(Quicken* q) {
         switch(patch->type) {
             case (LABEL_PATCH):
             case (FUNCTION_PATCH): {
-                Entry* entry = get_entry_by_int(q, patch->name);
-                ((void**)(q->code_buffer->code + patch->code_pos))[0] = q->code_buffer->code + entry->code_idx;
+                Entry* entry = get_entry(q, patch->name);
+                int offset = entry->code_idx - (patch->code_pos + (int) sizeof(int));
+                patch_int(q->code_buffer, patch->code_pos, offset);
                 break;
             } case(INT_PATCH): {
                 int idx = get_global_idx(q, patch->name);
-                ((int*)(q->code_buffer->code + patch->code_pos))[0] = idx;
+                patch_short(q->code_buffer, patch->code_pos, idx);
                 break;
             } case (CLASS_ARITY_PATCH): {
-                Entry* entry = get_entry_by_int(q, patch->name);
+                Entry* entry = get_entry(q, patch->name);
                 CClass* class = vector_get(q->classes, entry->class_idx);
-                ((short*)(q->code_buffer->code + patch->code_pos))[0] = class->nvars;
+                patch_short(q->code_buffer, patch->code_pos, class->nvars);
                 break;
             } case (CLASS_TAG_PATCH): {
-                Entry* entry = get_entry_by_int(q, patch->name);
-                ((short*)(q->code_buffer->code + patch->code_pos))[0] = entry->class_idx;
+                Entry* entry = get_entry(q, patch->name);
+                patch_short(q->code_buffer, patch->code_pos, entry->class_idx);
                 break;
             }
             default: {
@@ -437,6 +442,6 @@ char* process_programe(Quicken* q) {
     process_classes(q);
     process_globals(q);
     process_patches(q);
-    Entry* entry = get_entry_by_int(q, q->program->entry);
+    Entry* entry = get_entry(q, q->program->entry);
     return q->code_buffer->code + entry->code_idx;
 }
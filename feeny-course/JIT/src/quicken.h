@@ -5,14 +5,38 @@
 #include "ht.h"
 #include "codebuffer.h"
 
+// Direct-threaded dispatch writes handler addresses instead of opcodes into
+// the code stream and relies on GCC's labels-as-values. Build with
+// -DSWITCH_DISPATCH to fall back to the portable switch loop.
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#define THREADED
+#endif
+
+typedef enum {
+    NO_ENTRY,
+    METHOD_ENTRY,
+    LABEL_ENTRY,
+    CLASS_ENTRY,
+} TYPE_ENTRY;
+
+typedef struct {
+    TYPE_ENTRY type;
+    union {
+        int code_idx;
+        int class_idx;
+    };
+} Entry;
+
 typedef struct {
     Vector* patch_buffer;
     Vector* globals;
     Program* program;
-    ht* hm;
+    Entry* entries;
+    int* global_idx;
     Code* code_buffer;
     Vector* classes;
     Vector* const_pool;
+    void** handlers;
 } Quicken;
 
 typedef struct {
@@ -44,20 +68,6 @@ typedef enum {
   FRAME_INS       
 } OpTag;
 
-typedef enum {
-    METHOD_ENTRY,
-    LABEL_ENTRY,
-    CLASS_ENTRY,
-} TYPE_ENTRY;
-
-typedef struct {
-    TYPE_ENTRY type;
-    union {
-        int code_idx;
-        int class_idx;
-    };
-} Entry;
-
 typedef enum {
     FUNCTION_PATCH,
     LABEL_PATCH,
@@ -92,6 +102,6 @@ typedef struct {
   CSlot* slots;
 } CClass;
 
-VMInfo* quicken_vm(Program* program);
+VMInfo* quicken_vm(Program* program, void** handlers);
 
 #endif
\ No newline at end of file
@@ -4,66 +4,60 @@
 //---------------------------------------------------------------------------
 //--------------------------------init_vm------------------------------------
 //---------------------------------------------------------------------------
-Vector* fstack;
-int fp;
-
-int heap_size;
-char* heap_memory;
-char* heap_free;
-char* heap_head;
-char* heap_sp;
-
-intptr_t* genv;
-int genv_size;
-
-Vector* classes;
-Code* code_buffer;
-Vector* stack;
-intptr_t null;
-char* ip;
-
-void init_frame();
-void init_genv(int globals_size);
-void runvm();
-void init_heap();
-void free_heap();
+// All interpreter state lives in the VM passed to every function, so several
+// VMs can run in one process. Only the handler table is shared.
+StackFrame* init_frame();
+void free_frame(StackFrame* stack_frame);
+void init_genv(VM* vm, int globals_size);
+void runvm(VM* vm);
+Heap* init_heap();
+void free_heap(Heap* heap);
 intptr_t create_null();
-void int_function_call(char* name);
-void array_function_call(char* name);
-
-void init_vm(VMInfo* vm_info) {
-    classes = vm_info->classes;
-    code_buffer = vm_info->code_buffer;
-    stack = make_vector();
-    init_heap();
-    init_frame();
-    null = create_null();
-    ip = vm_info->ip;
-    init_genv(vm_info->globals_size);
-}
-
-void init_genv(int globals_size) {
-    genv = malloc(sizeof(intptr_t) * globals_size);
+void int_function_call(VM* vm, char* name);
+void array_function_call(VM* vm, char* name);
+
+VM* init_vm(VMInfo* vm_info) {
+    VM* vm = malloc(sizeof(VM));
+    vm->classes = vm_info->classes;
+    vm->code_buffer = vm_info->code_buffer;
+    vm->stack = make_vector();
+    vm->heap = init_heap();
+    vm->fstack = init_frame();
+    vm->null = create_null();
+    vm->ip = vm_info->ip;
+    init_genv(vm, vm_info->globals_size);
+    return vm;
+}
+
+void init_genv(VM* vm, int globals_size) {
+    vm->genv = malloc(sizeof(intptr_t) * globals_size);
     for (int i = 0; i < globals_size; i++) {
-        genv[i] = null;
+        vm->genv[i] = vm->null;
     }
-    genv_size = globals_size;
+    vm->genv_size = globals_size;
 }
 
-void free_vm() {
-    vector_free(classes);
-    free_code_buffer(code_buffer);
-    vector_free(fstack);
-    vector_free(stack);
-    free_heap();
-    free(genv);
+void free_vm(VM* vm) {
+    vector_free(vm->classes);
+    free_code_buffer(vm->code_buffer);
+    free_frame(vm->fstack);
+    vector_free(vm->stack);
+    free_heap(vm->heap);
+    free(vm->genv);
+    free(vm);
 }
 
+// Filled in by runvm(NULL) before quickening so handler addresses can be threaded.
+void** op_handlers;
+
 void interpret_bc(Program* program) {
-    VMInfo* info = quicken_vm(program);
-    init_vm(info);
-    runvm();
-    free_vm();
+    #ifdef THREADED
+        runvm(NULL);
+    #endif
+    VMInfo* info = quicken_vm(program, op_handlers);
+    VM* vm = init_vm(info);
+    runvm(vm);
+    free_vm(vm);
 }
 
 
@@ -72,13 +66,13 @@ void interpret_bc(Program* program) {
 //===================== Classes ==================================================
 //---------------------------------------------------------------------------
 
-CSlot get_slot(VMObj* obj, char* name) {
-    CClass* class = vector_get(classes, obj->tag);
+CSlot get_slot(VM* vm, VMObj* obj, char* name) {
+    CClass* class = vector_get(vm->classes, obj->tag);
     for (int i = 0; i < class->nslots; i++) {
         CSlot slot = class->slots[i];
         if (strcmp(name, slot.name) == 0) return slot;
     }
-    return get_slot(obj->parent, name);
+    return get_slot(vm, obj->parent, name);
 }
 
 //---------------------------------------------------------------------------
@@ -122,38 +116,45 @@ int get_tag_value(intptr_t value) {
 //===================== VM ==================================================
 //---------------------------------------------------------------------------
 
-unsigned char next_char () {
-  unsigned char c = ip[0];
-  ip++;
+// The readers advance runvm's ip, which only goes through the VM when
+// runvm starts.
+unsigned char next_char (char** ip) {
+  unsigned char c = (*ip)[0];
+  (*ip)++;
   return c;
 }
 
-int next_short () {
-  ip = (char*)(((long)ip + 1)&(-2));
-  int s = ((unsigned short*)ip)[0];  
-  ip += 2;
+int next_short (char** ip) {
+  unsigned short s;
+  memcpy(&s, *ip, sizeof(unsigned short));
+  *ip += sizeof(unsigned short);
   return s;
 }
 
-int next_int () {
-  ip = (char*)(((long)ip + 3)&(-4));
-  int s = ((int*)ip)[0];  
-  ip += 4;
+int next_int (char** ip) {
+  int s;
+  memcpy(&s, *ip, sizeof(int));
+  *ip += sizeof(int);
   return s;
 }
 
-void* next_ptr () {
-  ip = (char*)(((long)ip + 7)&(-8));
-  void* s = ((void**)ip)[0];  
-  ip += 8;
+void* next_ptr (char** ip) {
+  void* s;
+  memcpy(&s, *ip, sizeof(void*));
+  *ip += sizeof(void*);
   return s;
 }
 
-void* format_print(char* string, int nargs) {
+char* next_label (char** ip) {
+  int offset = next_int(ip);
+  return *ip + offset;
+}
+
+void* format_print(VM* vm, char* string, int nargs) {
     int i = 0;
     while (*string != '\0') {
         if (*string == '~') {
-            printf("%d", get_int((intptr_t) vector_get(stack, stack->size - nargs + i)));
+            printf("%d", get_int((intptr_t) vector_get(vm->stack, vm->stack->size - nargs + i)));
             string++;
             i++;
         }
@@ -161,7 +162,7 @@ void* format_print(char* string, int nargs) {
         string++;
     }
     for (int i = 0; i < nargs; i++) {
-        vector_pop(stack);
+        vector_pop(vm->stack);
     }
 }
 
@@ -169,77 +170,85 @@ void* format_print(char* string, int nargs) {
 //--------------------------------StackFrame------------------------------------
 //---------------------------------------------------------------------------
 
-void init_frame() {
-    fstack = make_vector();
-    fp = 0;
+StackFrame* init_frame() {
+    StackFrame* frame = malloc(sizeof(StackFrame));
+    frame->stack = make_vector();
+    frame->fp = 0;
+    return frame;
+}
+
+void free_frame(StackFrame* stack_frame) {
+    vector_free(stack_frame->stack);
+    free(stack_frame);
 }
 
-void add_frame() {
-    int nargs = next_int();
-    int nlocals = next_int();
-    fp = (fstack->size > 0) ? fstack->size - 2 : 0; 
-    vector_set_length(fstack, fstack->size + nargs + nlocals, (void*) null);
+// ip and fp are runvm's registers, passed by reference so they can stay in
+// locals.
+static inline void add_frame(VM* vm, char** ip, int* fp) {
+    int nargs = next_short(ip);
+    int nlocals = next_short(ip);
+    *fp = (vm->fstack->stack->size > 0) ? vm->fstack->stack->size - 2 : 0; 
+    vector_set_length(vm->fstack->stack, vm->fstack->stack->size + nargs + nlocals, (void*) vm->null);
     for (int i = nargs; i > 0; i--) {
-        vector_set(fstack, fp + 1 + i, vector_pop(stack));
+        vector_set(vm->fstack->stack, *fp + 1 + i, vector_pop(vm->stack));
     }
 }
 
+static inline void push_call(VM* vm, char* code, char** ip, int* fp) {
+    vector_add(vm->fstack->stack, (void*) (intptr_t) *fp);
+    vector_add(vm->fstack->stack, *ip);
+    *ip = code;
+}
+
 //---------------------------------------------------------------------------
 //--------------------------------heap------------------------------------
 //---------------------------------------------------------------------------
-void run_gc();
-void init_heap() {
-    heap_size = MB;
-    heap_memory = malloc(heap_size);
-    heap_free = malloc(heap_size);
-    heap_head = heap_memory + heap_size;
-    heap_sp = heap_memory;
+void run_gc(VM* vm);
+Heap* init_heap() {
+    Heap* heap = malloc(sizeof(Heap));
+    heap->size = MB;
+    heap->memory = malloc(heap->size);
+    heap->free = malloc(heap->size);
+    heap->head = heap->memory + heap->size;
+    heap->sp = heap->memory;
+    return heap;
 }
 
-void switch_heap() {
-    char* current_heap = heap_memory;
-    heap_memory = heap_free;
-    heap_free = current_heap;
-    heap_sp = heap_memory;
-    heap_head = heap_memory + heap_size;
+void switch_heap(Heap* heap) {
+    char* current_heap = heap->memory;
+    heap->memory = heap->free;
+    heap->free = current_heap;
+    heap->sp = heap->memory;
+    heap->head = heap->memory + heap->size;
 }
 
-void free_heap() {
-    free(heap_memory);
-    free(heap_free);
+void free_heap(Heap* heap) {
+    free(heap->memory);
+    free(heap->free);
+    free(heap);
 }
 
-void* halloc (long tag, int sz) {
-  run_gc();
-  if(heap_sp + sz > heap_head){
+void* halloc (VM* vm, long tag, int sz) {
+  if(vm->heap->sp + sz > vm->heap->head){
       printf("Calling GC.\n");
-      if(heap_sp + sz > heap_head) {
+      run_gc(vm);
+      if(vm->heap->sp + sz > vm->heap->head) {
         printf("Out of memory.");
         exit(-1);
       }
     }
-  long* obj = (long*)heap_sp;
+  long* obj = (long*)vm->heap->sp;
   obj[0] = tag;
-  heap_sp += sz;
+  vm->heap->sp += sz;
   return obj;
 }
 
-VMArray* create_array(intptr_t length) {
-    int int_length = get_int(length);
-    VMArray* array = (VMArray*) halloc(VM_ARRAY, sizeof(VMArray) + sizeof(void*) * int_length);
-    array->length = int_length;
-    return array;
-}
-
-VMObj* create_object(int class, int arity) {
-  VMObj* obj = halloc(class, sizeof(VMObj) + sizeof(void*) * arity);
-}
 //---------------------------------------------------------------------------
 //--------------------------------run gc------------------------------------
 //---------------------------------------------------------------------------
 long BHEART = -1;
 
-int get_obj_size(VMValue* obj) {
+int get_obj_size(VM* vm, VMValue* obj) {
     int sz;
     switch(obj->tag) {
         case VM_NULL: 
@@ -253,7 +262,7 @@ int get_obj_size(VMValue* obj) {
             sz = sizeof(VMArray) + sizeof(void*) * array->length;
             break;
         default:
-            CClass* class = vector_get(classes, obj->tag);
+            CClass* class = vector_get(vm->classes, obj->tag);
             sz = sizeof(VMObj) + sizeof(void*) * class->nvars;
             break;
     }
@@ -267,15 +276,15 @@ intptr_t forward_pointer(void* src, void* dst) {
     return bheart->forwarding;
 }
 
-intptr_t copy_to_free(void* obj) {
-    void* dst = heap_sp;
-    int sz = get_obj_size((VMValue*) obj);
+intptr_t copy_to_free(VM* vm, void* obj) {
+    void* dst = vm->heap->sp;
+    int sz = get_obj_size(vm, (VMValue*) obj);
     memcpy(dst, obj, sz);
-    heap_sp += sz;
+    vm->heap->sp += sz;
     return forward_pointer(obj, dst);
 }
 
-intptr_t get_post_gc_ptr(intptr_t obj_ptr) {
+intptr_t get_post_gc_ptr(VM* vm, intptr_t obj_ptr) {
     switch(get_tag_value(obj_ptr)) {
         case INT_PTAG:
         case NULL_PTAG:
@@ -287,207 +296,269 @@ intptr_t get_post_gc_ptr(intptr_t obj_ptr) {
                 BHeart* bheart = (BHeart*) obj;
                 return bheart->forwarding;
             } else {
-                return copy_to_free(obj);
+                return copy_to_free(vm, obj);
             }
     }
 }
 
-void scan_stack() {
-    for (int i = 0; i < stack->size; i++) {
-        intptr_t new_obj = get_post_gc_ptr((intptr_t) vector_get(stack, i));
-        vector_set(stack, i, (void*) new_obj);
+void scan_stack(VM* vm) {
+    for (int i = 0; i < vm->stack->size; i++) {
+        intptr_t new_obj = get_post_gc_ptr(vm, (intptr_t) vector_get(vm->stack, i));
+        vector_set(vm->stack, i, (void*) new_obj);
     }
 }
 
-void scan_stack_frame() {
-    int frame_start = fp + 2;
-    int frame_end = fstack->size;
+void scan_stack_frame(VM* vm) {
+    int frame_start = vm->fstack->fp + 2;
+    int frame_end = vm->fstack->stack->size;
     while (frame_end > 0) {
         for (int i = frame_start; i < frame_end; i++) {
-            intptr_t new_obj = get_post_gc_ptr((intptr_t) vector_get(fstack, i));
-            vector_set(fstack, i, (void*) new_obj);
+            intptr_t new_obj = get_post_gc_ptr(vm, (intptr_t) vector_get(vm->fstack->stack, i));
+            vector_set(vm->fstack->stack, i, (void*) new_obj);
         }
         frame_end = frame_start - 2;
-        frame_start = ((int) vector_get(fstack, frame_start - 2)) + 2;
+        frame_start = ((int) vector_get(vm->fstack->stack, frame_start - 2)) + 2;
     }
 }
 
-void scan_globals() {
-    for (int i = 0; i < genv_size; i++) {
-        genv[i] = get_post_gc_ptr((intptr_t) genv[i]);
+void scan_globals(VM* vm) {
+    for (int i = 0; i < vm->genv_size; i++) {
+        vm->genv[i] = get_post_gc_ptr(vm, (intptr_t) vm->genv[i]);
     }
 }
 
-void scan_root_set() {
-    scan_stack();
-    scan_stack_frame();
-    scan_globals();
+void scan_root_set(VM* vm) {
+    scan_stack(vm);
+    scan_stack_frame(vm);
+    scan_globals(vm);
 }
 
-void scan_array(VMArray* array) {
+void scan_array(VM* vm, VMArray* array) {
     for (int i = 0; i < array->length; i++) {
-        array->items[i] = get_post_gc_ptr((intptr_t) array->items[i]);
+        array->items[i] = get_post_gc_ptr(vm, (intptr_t) array->items[i]);
     }
 }
 
-void scan_object(VMObj* obj) {
-    CClass* class = vector_get(classes, obj->tag);
-    obj->parent = get_obj(get_post_gc_ptr(set_obj_bit((VMValue*) obj->parent)));
+void scan_object(VM* vm, VMObj* obj) {
+    CClass* class = vector_get(vm->classes, obj->tag);
+    obj->parent = get_obj(get_post_gc_ptr(vm, set_obj_bit((VMValue*) obj->parent)));
     for (int i = 0; i < class->nvars; i++) {
-        obj->slots[i] = get_post_gc_ptr((intptr_t) obj->slots[i]);
+        obj->slots[i] = get_post_gc_ptr(vm, (intptr_t) obj->slots[i]);
     }
 }
 
-void scan_heap() {
-    char* obj = heap_memory;
-    while (obj < heap_sp) {
+void scan_heap(VM* vm) {
+    char* obj = vm->heap->memory;
+    while (obj < vm->heap->sp) {
         VMValue* value = (VMValue*) obj;
         switch(value->tag) {
             case VM_INT: 
             case VM_NULL:
                 break;
             case VM_ARRAY:
-                scan_array((VMArray*) value);
+                scan_array(vm, (VMArray*) value);
                 break;
             default:
-                scan_object((VMObj*) value);
+                scan_object(vm, (VMObj*) value);
                 break;
         }
-        obj += get_obj_size(value);
+        obj += get_obj_size(vm, value);
     }
 }
 
 
-void run_gc() {
-    switch_heap();
-    scan_root_set();
-    scan_heap();
+void run_gc(VM* vm) {
+    switch_heap(vm->heap);
+    scan_root_set(vm);
+    scan_heap(vm);
 }
 
 //---------------------------------------------------------------------------
 //--------------------------------run vm------------------------------------
 //---------------------------------------------------------------------------
 
-void runvm () {  
-  while (ip) {
-    int tag = next_int();
-    #ifdef DEBUG
-        printf("STACK: ");
-        for (int i = 0; i < stack->size; i++) {
-            intptr_t value = (intptr_t) vector_get(stack, i);
-            switch(get_tag_value(value)) {
-                case INT_PTAG: 
-                    printf("int: %d, ", get_int(value));
-                    break;
-                case NULL_PTAG:
-                    printf("null, ");
-                    break;
-                case OBJ_PTAG:
-                    VMValue* value2 = get_obj(value);
-                    switch(value2->tag) {
-                        case VM_ARRAY:
-                            VMArray* array = (VMArray*) value2;
-                            printf("(");
-                            for(int i = 0; i < array->length; i++) {
-                                printf("%d, ", get_int(array->items[i]));
-                            }
-                            printf(")");
-                            break;
-                        default :{
-                            VMObj* obj = (VMObj*) value2;
-                            printf("Class #%ld", obj->tag);
+#ifdef DEBUG
+void print_stack (VM* vm) {
+    printf("STACK: ");
+    for (int i = 0; i < vm->stack->size; i++) {
+        intptr_t value = (intptr_t) vector_get(vm->stack, i);
+        switch(get_tag_value(value)) {
+            case INT_PTAG: 
+                printf("int: %d, ", get_int(value));
+                break;
+            case NULL_PTAG:
+                printf("null, ");
+                break;
+            case OBJ_PTAG:
+                VMValue* value2 = get_obj(value);
+                switch(value2->tag) {
+                    case VM_ARRAY:
+                        VMArray* array = (VMArray*) value2;
+                        printf("(");
+                        for(int i = 0; i < array->length; i++) {
+                            printf("%d, ", get_int(array->items[i]));
                         }
+                        printf(")");
+                        break;
+                    default :{
+                        VMObj* obj = (VMObj*) value2;
+                        printf("Class #%ld", obj->tag);
                     }
-                    break;
                 }
-        }
-        printf("\n");
+                break;
+            }
+    }
+    printf("\n");
+}
+#endif
+
+// ip, fp and the heap bump pointer live in runvm's locals. They are written
+// back to the VM only around a collection, which walks the frames from
+// vm->fstack->fp and copies into vm->heap, and when runvm exits.
+#define SAVE_STATE() (vm->ip = ip, vm->fstack->fp = fp, vm->heap->sp = hp)
+#define LOAD_STATE() (ip = vm->ip, fp = vm->fstack->fp, hp = vm->heap->sp)
+
+#define ALLOC(obj, tag, sz) do { \
+    if (hp + (sz) <= vm->heap->head) { \
+        obj = (void*) hp; \
+        *(long*) hp = (tag); \
+        hp += (sz); \
+    } else { \
+        SAVE_STATE(); \
+        obj = halloc(vm, (tag), (sz)); \
+        LOAD_STATE(); \
+    } \
+} while (0)
+
+// In threaded mode every handler ends in its own indirect jump through the
+// handler address that quicken wrote in place of the opcode.
+#ifdef THREADED
+  #ifdef DEBUG
+    #define NEXT() do { print_stack(vm); goto *next_ptr(&ip); } while (0)
+  #else
+    #define NEXT() goto *next_ptr(&ip)
+  #endif
+  #define OP(tag) L_##tag
+#else
+  #define NEXT() break
+  #define OP(tag) case tag
+#endif
+
+void runvm (VM* vm) {
+  #ifdef THREADED
+  static void* handlers[] = {
+    &&L_INT_INS, &&L_NULL_INS, &&L_PRINTF_INS, &&L_ARRAY_INS, &&L_OBJECT_INS,
+    &&L_SLOT_INS, &&L_SET_SLOT_INS, &&L_CALL_SLOT_INS, &&L_CALL_INS,
+    &&L_SET_LOCAL_INS, &&L_GET_LOCAL_INS, &&L_SET_GLOBAL_INS,
+    &&L_GET_GLOBAL_INS, &&L_BRANCH_INS, &&L_GOTO_INS, &&L_RETURN_INS,
+    &&L_DROP_INS, &&L_FRAME_INS
+  };
+  if (vm == NULL) {
+    op_handlers = handlers;
+    return;
+  }
+  char* ip = vm->ip;
+  int fp = vm->fstack->fp;
+  char* hp = vm->heap->sp;
+  NEXT();
+  #else
+  char* ip = vm->ip;
+  int fp = vm->fstack->fp;
+  char* hp = vm->heap->sp;
+  while (ip) {
+    int tag = next_char(&ip);
+    #ifdef DEBUG
+        print_stack(vm);
     #endif
     switch (tag) {
-        case INT_INS : {
-            int i = next_int();
+  #endif
+        OP(INT_INS) : {
+            int i = next_int(&ip);
             intptr_t value = create_int(i);
             #ifdef DEBUG
                 printf("int ins val: %d\n", i);
             #endif
-            vector_add(stack, (void*) value);
-            break;
+            vector_add(vm->stack, (void*) value);
+            NEXT();
         }
-        case NULL_INS : {
+        OP(NULL_INS) : {
             #ifdef DEBUG
                 printf("null ins\n");
             #endif
-            intptr_t value = null;
-            vector_add(stack, (void*) value);
-            break;
+            intptr_t value = vm->null;
+            vector_add(vm->stack, (void*) value);
+            NEXT();
         }
-        case PRINTF_INS : {
-            int nargs = next_int();
-            char* str = next_ptr();
+        OP(PRINTF_INS) : {
+            int nargs = next_short(&ip);
+            char* str = next_ptr(&ip);
             #ifdef DEBUG
                 printf("print: %d and str: %s\n", nargs, str);
             #endif
-            format_print(str, nargs);
-            vector_add(stack, (void*) null);
-            break;
+            format_print(vm, str, nargs);
+            vector_add(vm->stack, (void*) vm->null);
+            NEXT();
         }
-        case ARRAY_INS : {
+        OP(ARRAY_INS) : {
             #ifdef DEBUG
                 printf("array\n");
             #endif
-            intptr_t length = (intptr_t) vector_get(stack, stack->size - 2);
-            VMArray* array = create_array(length);
-            intptr_t initial = (intptr_t) vector_pop(stack);
-            vector_pop(stack);
+            int length = get_int((intptr_t) vector_get(vm->stack, vm->stack->size - 2));
+            VMArray* array;
+            ALLOC(array, VM_ARRAY, sizeof(VMArray) + sizeof(void*) * length);
+            array->length = length;
+            intptr_t initial = (intptr_t) vector_pop(vm->stack);
+            vector_pop(vm->stack);
             for (int i = 0; i < array->length; i++) {
                 array->items[i] = initial;
             }
-            vector_add(stack, (void*) set_obj_bit((VMValue*) array));
-            break;
+            vector_add(vm->stack, (void*) set_obj_bit((VMValue*) array));
+            NEXT();
         }
-        case OBJECT_INS: {
-            int arity = next_int();
-            int class = next_int();
+        OP(OBJECT_INS) : {
+            int arity = next_short(&ip);
+            int class = next_short(&ip);
             #ifdef DEBUG
                 printf("object \n");
             #endif
-            VMObj* obj = create_object(class, arity);
+            VMObj* obj;
+            ALLOC(obj, class, sizeof(VMObj) + sizeof(void*) * arity);
             for (int i = arity - 1; i >= 0; i--) {
-                obj->slots[i] = vector_pop(stack);
+                obj->slots[i] = vector_pop(vm->stack);
             }
-            intptr_t parent_ptr = (intptr_t) vector_pop(stack);
+            intptr_t parent_ptr = (intptr_t) vector_pop(vm->stack);
             obj->parent = (VMObj*) get_obj(parent_ptr);
-            vector_add(stack, (void*) set_obj_bit((VMValue*) obj));
-            break;
+            vector_add(vm->stack, (void*) set_obj_bit((VMValue*) obj));
+            NEXT();
         }
-        case SLOT_INS: {
-            char* name = next_ptr();
-            intptr_t obj = (intptr_t) vector_pop(stack);
+        OP(SLOT_INS) : {
+            char* name = next_ptr(&ip);
+            intptr_t obj = (intptr_t) vector_pop(vm->stack);
             VMObj* vm_obj = (VMObj*) get_obj(obj);
-            CSlot slot = get_slot(vm_obj, name);
-            vector_add(stack, (void*) vm_obj->slots[slot.idx]);
-            break;
+            CSlot slot = get_slot(vm, vm_obj, name);
+            vector_add(vm->stack, (void*) vm_obj->slots[slot.idx]);
+            NEXT();
         }
-        case SET_SLOT_INS: {
-            char* name = next_ptr();
-            intptr_t value = (intptr_t) vector_pop(stack);
-            intptr_t obj =  (intptr_t) vector_pop(stack);
+        OP(SET_SLOT_INS) : {
+            char* name = next_ptr(&ip);
+            intptr_t value = (intptr_t) vector_pop(vm->stack);
+            intptr_t obj =  (intptr_t) vector_pop(vm->stack);
             VMObj* vm_obj = (VMObj*) get_obj(obj);
-            CSlot slot = get_slot(vm_obj, name);
+            CSlot slot = get_slot(vm, vm_obj, name);
             vm_obj->slots[slot.idx] = value;
-            vector_add(stack, (void*) value);
-            break;
+            vector_add(vm->stack, (void*) value);
+            NEXT();
         }
-        case CALL_SLOT_INS: {
-            int arity = next_int();
-            char* name = next_ptr();
+        OP(CALL_SLOT_INS) : {
+            int arity = next_short(&ip);
+            char* name = next_ptr(&ip);
             #ifdef DEBUG
                 printf("call-op #%d and str: %s\n", arity, name);
             #endif
-            intptr_t ptr = (intptr_t) vector_get(stack, stack->size - arity);
+            intptr_t ptr = (intptr_t) vector_get(vm->stack, vm->stack->size - arity);
             switch(get_tag_value(ptr)) {
                 case INT_PTAG: {
-                    int_function_call(name);
+                    int_function_call(vm, name);
                     break;
                 } case NULL_PTAG: {
                     printf("No slots can be called on null value");
@@ -496,113 +567,114 @@ void runvm () {
                     VMValue* value = get_obj(ptr);
                     switch(value->tag) {
                         case VM_ARRAY: {
-                            array_function_call(name);
+                            array_function_call(vm, name);
                             break;
                         }
                         default : {
                             VMObj* obj = (VMObj*) value;
-                            CSlot slot = get_slot(obj, name);
-                            vector_add(fstack, (void*) fp);
-                            vector_add(fstack, ip);
-                            ip = slot.code;
+                            CSlot slot = get_slot(vm, obj, name);
+                            push_call(vm, slot.code, &ip, &fp);
                             break;
                         }
                     }   
                 }
             }
-            break;
+            NEXT();
         }
-        case CALL_INS : {
-            int arity = next_int();
-            void* new_code = next_ptr();
+        OP(CALL_INS) : {
+            int arity = next_short(&ip);
+            void* new_code = next_label(&ip);
             #ifdef DEBUG
                 printf("calls #%d and ptr: %p\n", arity, new_code);
             #endif
-            vector_add(fstack, (void*) fp);
-            vector_add(fstack, ip);
-            ip = new_code;
-            break;
+            push_call(vm, new_code, &ip, &fp);
+            NEXT();
         }
-        case SET_LOCAL_INS : {
-            int idx = next_int();
+        OP(SET_LOCAL_INS) : {
+            int idx = next_short(&ip);
             #ifdef DEBUG
                 printf("set local : %d at: %d\n", idx, fp + 2 + idx);
             #endif
-            vector_set(fstack, fp + 2 + idx, vector_peek(stack));
-            break;
+            vector_set(vm->fstack->stack, fp + 2 + idx, vector_peek(vm->stack));
+            NEXT();
         }
-        case GET_LOCAL_INS : {
-            int idx = next_int();
+        OP(GET_LOCAL_INS) : {
+            int idx = next_short(&ip);
             #ifdef DEBUG
                 printf("get local : %d\n", idx);
             #endif
-            vector_add(stack, vector_get(fstack, fp + 2 + idx));
-            break;
+            vector_add(vm->stack, vector_get(vm->fstack->stack, fp + 2 + idx));
+            NEXT();
         }
-        case SET_GLOBAL_INS : {
-            int idx = next_int();
+        OP(SET_GLOBAL_INS) : {
+            int idx = next_short(&ip);
             #ifdef DEBUG
                 printf("set global : %d\n", idx);
             #endif
-            genv[idx] = vector_peek(stack);
-            break;
+            vm->genv[idx] = vector_peek(vm->stack);
+            NEXT();
         }
-        case GET_GLOBAL_INS : {
-            int idx = next_int();
+        OP(GET_GLOBAL_INS) : {
+            int idx = next_short(&ip);
             #ifdef DEBUG
                 printf("get global : %d\n", idx);
             #endif
-            vector_add(stack, (void*) genv[idx]);
-            break;
+            vector_add(vm->stack, (void*) vm->genv[idx]);
+            NEXT();
         }
-        case BRANCH_INS : {
-            void* new_ptr = next_ptr();
-            intptr_t value = (intptr_t) vector_pop(stack);
+        OP(BRANCH_INS) : {
+            void* new_ptr = next_label(&ip);
+            intptr_t value = (intptr_t) vector_pop(vm->stack);
             #ifdef DEBUG
                 printf("branch tag: %d, ptr: %p\n", get_tag_value(value), new_ptr);
             #endif
             if(get_tag_value(value) != NULL_PTAG) ip = new_ptr;
-            break;
+            NEXT();
         }
-        case GOTO_INS : {
-            void* ptr = next_ptr();
+        OP(GOTO_INS) : {
+            void* ptr = next_label(&ip);
             #ifdef DEBUG
                 printf("goto ins, ptr: %p\n", ptr);
             #endif
             ip = ptr;
-            break;
+            NEXT();
         }
-        case RETURN_INS : {
+        OP(RETURN_INS) : {
             #ifdef DEBUG
                 printf("return ins\n");
             #endif
-            if (fstack->size == 0) return;
-            int old_fp = (int) vector_get(fstack, fp);
-            ip = vector_get(fstack, fp + 1); 
-            vector_set_length(fstack, fp, (void*) null);
+            if (vm->fstack->stack->size == 0) {
+                SAVE_STATE();
+                return;
+            }
+            int old_fp = (intptr_t) vector_get(vm->fstack->stack, fp);
+            ip = vector_get(vm->fstack->stack, fp + 1); 
+            vector_set_length(vm->fstack->stack, fp, (void*) vm->null);
             fp = old_fp;
-            break;
+            NEXT();
         }
-        case DROP_INS : {
+        OP(DROP_INS) : {
             #ifdef DEBUG
                 printf("drop ins\n");
             #endif
-            vector_pop(stack);
-            break;
+            vector_pop(vm->stack);
+            NEXT();
         }
-        case FRAME_INS : {
+        OP(FRAME_INS) : {
             #ifdef DEBUG
                 printf("frame ins\n");
             #endif
-            add_frame();
-            break;
+            add_frame(vm, &ip, &fp);
+            NEXT();
         }
+  #ifndef THREADED
         default: {
             printf("Unknown tag: %d\n", tag);
             exit(-1);
         }
     }  
   }
+  #endif
 }
 
 
@@ -611,25 +683,25 @@ void runvm () {
 //===================== BUILTINS ============================================
 //---------------------------------------------------------------------------
 
-intptr_t create_null_or_int(int a) {
+intptr_t create_null_or_int(VM* vm, int a) {
   if (a) return create_int(a);
-  else return null;
+  else return vm->null;
 }
 
-void int_function_call(char* name) {
-    intptr_t y = (intptr_t) vector_pop(stack);
-    intptr_t x = (intptr_t) vector_pop(stack);
+void int_function_call(VM* vm, char* name) {
+    intptr_t y = (intptr_t) vector_pop(vm->stack);
+    intptr_t x = (intptr_t) vector_pop(vm->stack);
     intptr_t value;
     if(strcmp(name, "eq") == 0)
-        value = create_null_or_int(x == y);
+        value = create_null_or_int(vm, x == y);
     else if(strcmp(name, "lt") == 0)
-        value = create_null_or_int(x < y);
+        value = create_null_or_int(vm, x < y);
     else if(strcmp(name, "le") == 0)
-        value = create_null_or_int(x <= y);
+        value = create_null_or_int(vm, x <= y);
     else if(strcmp(name, "gt") == 0)
-        value =  create_null_or_int(x > y);
+        value =  create_null_or_int(vm, x > y);
     else if(strcmp(name, "ge") == 0)
-        value = create_null_or_int(x >= y);
+        value = create_null_or_int(vm, x >= y);
     else if(strcmp(name, "add") == 0)
         value = x + y;
     else if(strcmp(name, "sub") == 0)
@@ -644,30 +716,30 @@ void int_function_call(char* name) {
         printf("No slot named %s for Int.\n", name);
         exit(-1);
     }
-    vector_add(stack, (void*) value);
+    vector_add(vm->stack, (void*) value);
 }
 
-void array_function_call(char* name) {
+void array_function_call(VM* vm, char* name) {
     intptr_t value;
     if(strcmp(name, "get") == 0) {
-        intptr_t i = (intptr_t) vector_pop(stack);
-        intptr_t array_ptr = (intptr_t) vector_pop(stack);
+        intptr_t i = (intptr_t) vector_pop(vm->stack);
+        intptr_t array_ptr = (intptr_t) vector_pop(vm->stack);
         VMArray* array = (VMArray*) get_obj(array_ptr);
         value = array->items[get_int(i)];
     } else if(strcmp(name, "set") == 0) {
-        intptr_t value = (intptr_t) vector_pop(stack);
-        intptr_t pos = (intptr_t) vector_pop(stack);
-        intptr_t array_ptr = (intptr_t) vector_pop(stack);
+        intptr_t value = (intptr_t) vector_pop(vm->stack);
+        intptr_t pos = (intptr_t) vector_pop(vm->stack);
+        intptr_t array_ptr = (intptr_t) vector_pop(vm->stack);
         VMArray* array = (VMArray*) get_obj(array_ptr);
         array->items[get_int(pos)] = value;
-        value = null;
+        value = vm->null;
     } else if(strcmp(name, "length") == 0) {
-        intptr_t array_ptr = (intptr_t) vector_pop(stack);
+        intptr_t array_ptr = (intptr_t) vector_pop(vm->stack);
         VMArray* array = (VMArray*) get_obj(array_ptr);
         value = create_int(array->length);
     } else {
         printf("No slot named %s for Int.\n", name);
         exit(-1);
     }
-    vector_add(stack, (void*) value); 
+    vector_add(vm->stack, (void*) value); 
 }